@@ -22,6 +22,7 @@
  */
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stdint.h>
 
 #include <stdio.h>
@@ -50,6 +51,9 @@ typedef struct Spfilefid Spfilefid;
 typedef struct Spfileops Spfileops;
 typedef struct Spdirops Spdirops;
 typedef struct Spfd Spfd;
+typedef struct Sptimer Sptimer;
+typedef struct Sppollstats Sppollstats;
+typedef struct Spdata Spdata;
 
 /* message types */
 enum {
@@ -137,6 +141,7 @@ enum {
 #define MAXWELEM	16
 #define IOHDRSZ		24
 #define FID_HTABLE_SIZE 64
+#define TAG_HTABLE_SIZE 64
 
 struct Spstr {
 	u16		len;
@@ -227,9 +232,17 @@ struct Spfcall {
 	Spstr		extension;		/* Tcreate */
 	u32		n_uname;		/* Tauth, Tattach */
 
+	Spdata*		dataref;		/* Rread, data isn't in pkt */
 	Spfcall*	next;
 };
 
+/* refcounted data that Rread responses point to instead of copying it,
+   see sp_create_rread_ref */
+struct Spdata {
+	int		ref;
+	void		(*free)(Spdata *);
+};
+
 struct Spfid {
 	Spconn*		conn;
 	u32		fid;
@@ -246,8 +259,19 @@ struct Spfid {
 
 /* connection flags */
 enum {
-       Creset,
-       Cshutdown,
+       Creset		= 1,
+       Cshutdown	= 2,
+       Cthrottled	= 4,	/* not reading until the client catches up */
+       Cenomem		= 8,	/* not reading until rcenomem is sent */
+       Cfdcap		= 16,	/* the transport can pass file descriptors */
+       Cpassfd		= 32,	/* Ropen passes the open file, "9P2000.u.fd" */
+};
+
+/* sp_ethsrv2_set_xdp flags */
+enum {
+	Xdrvmode	= 1,	/* native XDP instead of generic (skb) mode */
+	Xzerocopy	= 2,	/* needs Xdrvmode and driver support */
+	Xbusypoll	= 4,
 };
 
 struct Spconn {
@@ -258,6 +282,8 @@ struct Spconn {
 	int		flags;
 	Spreq*		ireqs;          /* requests that didn't enter the srv queues yet */
 	Spreq*		oreqs;          /* requests that left the srv queues */
+	Spreq*		workreqs;	/* requests that are worked on */
+	Spreq*		tagpool[TAG_HTABLE_SIZE]; /* workreqs hashed by tag */
 	void*		caux;           /* implementation specific */
 	Spfid**		fidpool;
 	int		freercnum;
@@ -266,7 +292,15 @@ struct Spconn {
 	int		(*shutdown)(Spconn *);
 	void		(*dataout)(Spconn *, Spreq *req);
 
+	time_t		atime;		/* last time a request was received */
+	int		nreqs;		/* requests received, not sent back yet */
+	int		obytes;		/* size of the responses not sent yet */
+	int		nincalls;	/* incall buffers allocated, incl. freerclist */
+	Spfcall*	rcenomem;	/* preallocated to send if no memory */
+	Spreq*		enomemreqs;	/* waiting for rcenomem to be sent */
+
 	Spconn*		next;	/* list of connections within a server */
+	Spconn*		prev;
 };
 
 struct Spreq {
@@ -277,10 +311,14 @@ struct Spreq {
 	int		responded;
 	Spreq*		flushreq;
 	Spfid*		fid;
+	int		fd;	/* passed to the client with rcall, or -1 */
+	u32		wpos;	/* bytes of rcall written, if not all at once */
 	void*		caux;	/* connection specific data */
+	Spreq*		enomemnext; /* list of requests waiting for rcenomem */
 
 	Spreq*		next;	/* list of all outstanding requests */
 	Spreq*		prev;	/* used for requests that are worked on */
+	Spreq*		tnext;	/* list of requests within a tag bucket */
 };
 
 struct Spauth {
@@ -323,12 +361,21 @@ struct Spsrv {
 	Spfcall*	(*stat)(Spfid *fid);
 	Spfcall*	(*wstat)(Spfid *fid, Spstat *stat);
 
+	/* the open file of the fid, to pass to the client, or -1 */
+	int		(*openfd)(Spfid *fid);
+
+	int		maxconns;	/* refuse new connections above, 0: no limit */
+	int		conntimeout;	/* secs before an idle conn is closed, 0: never */
+	int		maxreqs;	/* stop reading from a conn with more requests */
+	int		maxobytes;	/* or more bytes of responses queued, */
+	int		maxmem;		/* or more memory used by incalls and responses;
+					   reading resumes when all drop to half,
+					   0: no limit */
+
 	/* implementation specific */
 	Spconn*		conns;
-	Spreq*		workreqs;
-	int		enomem;		/* if set, returning Enomem Rerror */
-	Spfcall*	rcenomem;	/* preallocated to send if no memory */
-	Spfcall*	rcenomemu;	/* same for .u connections */
+	int		nconns;
+	Sptimer*	reaper;		/* closes the idle connections */
 };
 
 struct Spuser {
@@ -408,6 +455,15 @@ struct Spfilefid {
 	Spfile*		dirent;
 };
 
+/* busy polling of the thread's loop, see sp_poll_set_busypoll */
+struct Sppollstats {
+	unsigned long long	polls;		/* sp_poll_once calls */
+	unsigned long long	spins;		/* times the loop started spinning */
+	unsigned long long	spinhits;	/* spins that found an event */
+	unsigned long long	spinusec;	/* time spent spinning */
+	unsigned long long	blocks;		/* spins that ran out, then blocked */
+};
+
 extern char *Eunknownfid;
 extern char *Enomem;
 extern char *Enoauth;
@@ -425,6 +481,8 @@ extern char *Eopen;
 extern char *Eexist;
 extern char *Enotempty;
 extern char *Eunknownuser;
+extern char *Eduptag;
+extern char *Etoomanyconns;
 
 Spfd *spfd_add(int fd, void (*notify)(Spfd *, void *), void *aux);
 void spfd_remove(Spfd *spfd);
@@ -434,17 +492,21 @@ int spfd_can_write(Spfd *spfd);
 int spfd_has_error(Spfd *spfd);
 int spfd_read(Spfd *spfd, void *buf, int buflen);
 int spfd_write(Spfd *spfd, void *buf, int buflen);
+int spfd_writev(Spfd *spfd, struct iovec *iov, int iovcnt);
+Sptimer *sp_timer_add(int msec, void (*notify)(Sptimer *, void *), void *aux);
+void sp_timer_remove(Sptimer *t);
 void sp_poll_once();
 void sp_poll_loop(void);
 void sp_poll_stop(void);
 int sp_poll_looping(void);
+void sp_poll_set_busypoll(int usec);
+void sp_poll_get_stats(Sppollstats *st);
 
 Spsrv *sp_srv_create(void);
 void sp_srv_start(Spsrv *srv);
 int sp_srv_add_conn(Spsrv *srv, Spconn *conn);
 void sp_srv_remove_conn(Spsrv *srv, Spconn *conn);
 void sp_respond(Spreq *req, Spfcall *rcall);
-Spfcall *sp_srv_get_enomem(Spsrv *srv, int dotu);
 Spreq *sp_req_alloc(Spconn *conn, Spfcall *tc);
 void sp_req_free(Spreq *req);
 void sp_srv_process_req(Spreq *req);
@@ -456,9 +518,15 @@ void sp_conn_reset(Spconn *srv, u32 msize, int dotu);
 void sp_conn_respond(Spconn *conn, Spreq *req);
 Spfcall *sp_conn_new_incall(Spconn *conn);
 void sp_conn_free_incall(Spconn* conn, Spfcall *rc);
+int sp_conn_throttle(Spconn *conn);
+Spfcall *sp_conn_get_enomem(Spconn *conn);
+void sp_conn_wait_enomem(Spconn *conn, Spreq *req);
+int sp_conn_sent(Spconn *conn);
+int sp_conn_sent_keep(Spconn *conn, Spfcall **rcp);
 Spconn *sp_fdconn_create(Spsrv *srv, int fdin, int fdout);
-Spconn *sp_ethconn_create(Spsrv *srv, int fd);
 Spconn *sp_ethconn2_create(Spsrv *srv, void *saddr);
+Spconn *sp_shmconn_create(Spsrv *srv, int sock, int memfd, int evin, int evout);
+void sp_shmconn_set_spin(Spconn *conn, int maxspin);
 
 Spfid **sp_fidpool_create(void);
 void sp_fidpool_destroy(Spfid **);
@@ -507,6 +575,11 @@ Spfcall *sp_create_twstat(u32 fid, Spwstat *wstat, int dotu);
 Spfcall *sp_create_rwstat(void);
 Spfcall *sp_alloc_rread(u32);
 void sp_set_rread_count(Spfcall *, u32);
+Spfcall *sp_create_rread_ref(u32 count, u8 *data, Spdata *ref);
+void sp_data_incref(Spdata *);
+void sp_data_decref(Spdata *);
+int sp_fcall_iov(Spfcall *, u32 off, u32 len, struct iovec *iov);
+void sp_fcall_free(Spfcall *);
 
 Spuser* sp_uid2user(int uid);
 Spuser* sp_uname2user(char *uname);
@@ -516,8 +589,18 @@ int sp_usergroups(Spuser *u, gid_t **gids);
 int sp_change_user(Spuser *u);
 
 Spsrv *sp_socksrv_create_tcp(int*);
-Spsrv *sp_ethsrv_create(void);
+Spsrv *sp_socksrv_create_unix(char *path, int type);
+void sp_socksrv_set_backlog(Spsrv *srv, int backlog);
+void sp_socksrv_set_bufsize(Spsrv *srv, int rcvbuf, int sndbuf);
+void sp_socksrv_set_nodelay(Spsrv *srv, int nodelay);
+void sp_socksrv_set_busypoll(Spsrv *srv, int usec);
 Spsrv *sp_ethsrv2_create(char *);
+int sp_ethsrv2_set_rxring(Spsrv *srv, int nblocks);
+int sp_ethsrv2_set_xdp(Spsrv *srv, int queue, int flags);
+int sp_ethsrv2_set_fanout(Spsrv *srv, int id);
+int sp_ethsrv2_set_busypoll(Spsrv *srv, int usec);
+Spsrv *sp_shmsrv_create(char *path);
+void sp_shmsrv_set_spin(Spsrv *srv, int spin);
 Spsrv *sp_pipesrv_create();
 int sp_pipesrv_mount(Spsrv *srv, char *mntpt, char *user, int mntflags, char *opts);
 
@@ -45,6 +45,8 @@ sp_conn_create(Spsrv *srv)
 	conn->flags = 0;
 	conn->ireqs = NULL;
 	conn->oreqs = NULL;
+	conn->workreqs = NULL;
+	memset(conn->tagpool, 0, sizeof(conn->tagpool));
 	conn->caux = NULL;
 	conn->fidpool = NULL;
 	conn->freercnum = 0;
@@ -52,6 +54,20 @@ sp_conn_create(Spsrv *srv)
 	conn->reset = NULL;
 	conn->shutdown = NULL;
 	conn->dataout = NULL;
+	conn->atime = 0;
+	conn->nreqs = 0;
+	conn->obytes = 0;
+	conn->nincalls = 0;
+	conn->enomemreqs = NULL;
+	conn->next = NULL;
+	conn->prev = NULL;
+
+	/* preallocated, we can't create it when we run out of memory */
+	conn->rcenomem = sp_create_rerror(Enomem, ENOMEM, conn->dotu);
+	if (!conn->rcenomem) {
+		free(conn);
+		return NULL;
+	}
 
 	return conn;
 }
@@ -59,6 +75,16 @@ sp_conn_create(Spsrv *srv)
 void
 sp_conn_destroy(Spconn *conn)
 {
+	Spfcall *fc, *fc1;
+
+	/* the transport may have freed incalls after the reset, e.g.
+	   partly reassembled messages */
+	for(fc = conn->freerclist; fc != NULL; fc = fc1) {
+		fc1 = fc->next;
+		free(fc);
+	}
+
+	free(conn->rcenomem);
 	free(conn->address);
 	free(conn);
 }
@@ -92,27 +118,34 @@ sp_conn_reset(Spconn *conn, u32 msize, int dotu)
 	conn->flags |= Creset;
 	vreq = NULL;
 
+	/* the requests waiting for the Enomem error are dropped */
+	while (conn->enomemreqs != NULL) {
+		req = conn->enomemreqs;
+		conn->enomemreqs = req->enomemnext;
+		sp_respond(req, NULL);
+	}
+
 	/* flush all working requests */
-	/* if there are pending requests, the server should define flush, 
-	   otherwise we loop forever */
-again:
-	req = conn->srv->workreqs;
+	/* Tflush requests are answered with the request they flush; find
+	   the next request first, flush may respond and free the current */
+	req = conn->workreqs;
 	while (req != NULL) {
-		if (req->conn == conn) {
-			if (msize>0 && req->tcall->type==Tversion)
-				vreq = req;
-			else {
-				if (srv->flush)
-					rc = (*srv->flush)(req);
-				else
-					rc = NULL;
-
-				free(rc);
-				goto again;
-			}
+		for(req1 = req->next; req1 != NULL; req1 = req1->next)
+			if (req1->tcall->type != Tflush)
+				break;
+
+		if (msize>0 && req->tcall->type==Tversion)
+			vreq = req;
+		else if (req->tcall->type != Tflush) {
+			if (srv->flush)
+				rc = (*srv->flush)(req);
+			else
+				rc = NULL;
+
+			free(rc);
 		}
 
-		req = req->next;
+		req = req1;
 	}
 
 	if (conn->reset)
@@ -123,20 +156,13 @@ again:
 		while (req != NULL) {
 			req1 = req->next;
 			sp_conn_free_incall(conn, req->tcall);
-			free(req->rcall);
+			sp_fcall_free(req->rcall);
 			sp_req_free(req);
 			req = req1;
 		}
 
-		req = conn->oreqs;
-		conn->oreqs = NULL;
-		while (req != NULL) {
-			req1 = req->next;
-			sp_conn_free_incall(conn, req->tcall);
-			free(req->rcall);
-			sp_req_free(req);
-			req = req1;
-		}
+		while (conn->oreqs != NULL)
+			sp_conn_sent(conn);
 	}
 
 	conn->msize = msize;
@@ -149,8 +175,10 @@ again:
 	while (fc != NULL) {
 		fc1 = fc->next;
 		free(fc);
+		conn->nincalls--;
 		fc = fc1;
 	}
+	conn->freercnum = 0;
 
 	if (conn->fidpool) {
 		sp_fidpool_destroy(conn->fidpool);
@@ -158,6 +186,14 @@ again:
 	}
 
 	if (msize) {
+		if (dotu != conn->dotu) {
+			fc = sp_create_rerror(Enomem, ENOMEM, dotu);
+			if (fc) {
+				free(conn->rcenomem);
+				conn->rcenomem = fc;
+			}
+		}
+
 		conn->dotu = dotu;
 		conn->fidpool = sp_fidpool_create();
 	}
@@ -165,7 +201,7 @@ again:
 
 	/* if msize > 0, the reset was caused by Tversion, send the response back */
 	if (vreq) {
-		sprintf(buf, "9P2000%s", dotu?".u":"");
+		sprintf(buf, "9P2000%s%s", dotu?".u":"", conn->flags&Cpassfd?".fd":"");
 		rc = sp_create_rversion(conn->msize, buf);
 		sp_respond(vreq, rc);
 	}
@@ -177,12 +213,14 @@ sp_conn_respond(Spconn *conn, Spreq *req)
 	Spreq *preq;
 
 	if (!req->rcall) {
+		conn->nreqs--;
 		sp_conn_free_incall(conn, req->tcall);
 		sp_req_free(req);
 		return;
 	}
 
 	sp_set_tag(req->rcall, req->tcall->tag);
+	conn->obytes += req->rcall->size;
 	if (conn->oreqs) {
 		for(preq = conn->oreqs; preq->next != NULL; preq = preq->next)
 			;
@@ -198,6 +236,179 @@ sp_conn_respond(Spconn *conn, Spreq *req)
 		(*conn->dataout)(conn, req);
 }
 
+static int
+sp_conn_memused(Spconn *conn)
+{
+	return conn->nincalls * (sizeof(Spfcall) + conn->msize) + conn->obytes;
+}
+
+/* checks if the reading from the connection should stop until the client
+   reads enough of the responses */
+int
+sp_conn_throttle(Spconn *conn)
+{
+	Spsrv *srv;
+	Spreq *req;
+
+	srv = conn->srv;
+	if ((srv->maxreqs && conn->nreqs >= srv->maxreqs)
+	|| (srv->maxobytes && conn->obytes >= srv->maxobytes)
+	|| (srv->maxmem && sp_conn_memused(conn) >= srv->maxmem))
+		conn->flags |= Cthrottled;
+
+	/* answer the requests that waited for the Enomem error, one at a
+	   time, reading resumes after the last one is sent */
+	if (!(conn->flags & Cenomem) && conn->enomemreqs) {
+		req = conn->enomemreqs;
+		conn->enomemreqs = req->enomemnext;
+		sp_respond(req, sp_conn_get_enomem(conn));
+	}
+
+	return conn->flags & (Cthrottled | Cenomem);
+}
+
+/* returns the preallocated Enomem error, the connection doesn't read
+   any more requests until it is sent. If it is already queued, tries
+   to create another one, returns NULL if that fails too */
+Spfcall *
+sp_conn_get_enomem(Spconn *conn)
+{
+	if (conn->flags & Cenomem)
+		return sp_create_rerror(Enomem, ENOMEM, conn->dotu);
+
+	conn->flags |= Cenomem;
+	return conn->rcenomem;
+}
+
+/* the request gets the preallocated Enomem error after the one queued
+   is sent, when the connection tries to read again. The request keeps
+   its tag until then */
+void
+sp_conn_wait_enomem(Spconn *conn, Spreq *req)
+{
+	Spreq **reqp;
+
+	for(reqp = &conn->enomemreqs; *reqp != NULL; reqp = &(*reqp)->enomemnext)
+		;
+
+	req->enomemnext = NULL;
+	*reqp = req;
+}
+
+/* called by the transport when the first request in oreqs is sent,
+   returns 1 if the connection was blocked and can read again */
+int
+sp_conn_sent(Spconn *conn)
+{
+	return sp_conn_sent_keep(conn, NULL);
+}
+
+/* same as sp_conn_sent, but if rcp isn't NULL the response isn't freed,
+   it is returned in *rcp for transports that may have to resend it */
+int
+sp_conn_sent_keep(Spconn *conn, Spfcall **rcp)
+{
+	int ret;
+	Spsrv *srv;
+	Spreq *req;
+	Spfcall *rc;
+
+	ret = 0;
+	srv = conn->srv;
+	req = conn->oreqs;
+	rc = req->rcall;
+	conn->oreqs = req->next;
+	conn->nreqs--;
+	conn->obytes -= rc->size;
+	sp_conn_free_incall(conn, req->tcall);
+	sp_req_free(req);
+
+	if (rc == conn->rcenomem) {
+		/* unblock reading */
+		conn->flags &= ~Cenomem;
+		ret = 1;
+
+		/* the preallocated error is reused, give a copy */
+		if (rcp) {
+			*rcp = sp_malloc(sizeof(*rc) + rc->size);
+			if (*rcp) {
+				memcpy(*rcp, rc, sizeof(*rc) + rc->size);
+				(*rcp)->pkt = (u8 *) *rcp + sizeof(*rc);
+			}
+		}
+	} else if (rcp)
+		*rcp = rc;
+	else
+		sp_fcall_free(rc);
+
+	if (conn->flags&Cthrottled
+	&& (!srv->maxreqs || conn->nreqs<=srv->maxreqs/2)
+	&& (!srv->maxobytes || conn->obytes<=srv->maxobytes/2)
+	&& (!srv->maxmem || sp_conn_memused(conn)<=srv->maxmem/2)) {
+		conn->flags &= ~Cthrottled;
+		ret = 1;
+	}
+
+	return ret;
+}
+
+void
+sp_conn_add_workreq(Spconn *conn, Spreq *req)
+{
+	int hash;
+
+	if (conn->workreqs)
+		conn->workreqs->prev = req;
+
+	req->next = conn->workreqs;
+	conn->workreqs = req;
+	req->prev = NULL;
+
+	hash = req->tag % TAG_HTABLE_SIZE;
+	req->tnext = conn->tagpool[hash];
+	conn->tagpool[hash] = req;
+}
+
+void
+sp_conn_remove_workreq(Spconn *conn, Spreq *req)
+{
+	int hash;
+	Spreq *r, **prevp;
+
+	hash = req->tag % TAG_HTABLE_SIZE;
+	prevp = &conn->tagpool[hash];
+	for(r = *prevp; r != NULL; prevp = &r->tnext, r = *prevp)
+		if (r == req)
+			break;
+
+	/* not worked on, e.g. rejected because of a duplicate tag */
+	if (!r)
+		return;
+
+	*prevp = req->tnext;
+	req->tnext = NULL;
+
+	if (req->prev)
+		req->prev->next = req->next;
+	else
+		conn->workreqs = req->next;
+
+	if (req->next)
+		req->next->prev = req->prev;
+}
+
+Spreq *
+sp_conn_find_workreq(Spconn *conn, u16 tag)
+{
+	Spreq *req;
+
+	for(req = conn->tagpool[tag % TAG_HTABLE_SIZE]; req != NULL; req = req->tnext)
+		if (req->tag == tag)
+			break;
+
+	return req;
+}
+
 Spfcall *
 sp_conn_new_incall(Spconn *conn)
 {
@@ -207,8 +418,11 @@ sp_conn_new_incall(Spconn *conn)
 		fc = conn->freerclist;
 		conn->freerclist = fc->next;
 		conn->freercnum--;
-	} else
+	} else {
 		fc = sp_malloc(sizeof(*fc) + conn->msize);
+		if (fc)
+			conn->nincalls++;
+	}
 
 	if (!fc)
 		return NULL;
@@ -217,6 +431,26 @@ sp_conn_new_incall(Spconn *conn)
 	return fc;
 }
 
+/* take over an incall buffer the transport filled before it knew the
+   connection, return a free buffer of at least size bytes in exchange,
+   or NULL if there is none */
+Spfcall *
+sp_conn_swap_incall(Spconn *conn, Spfcall *fc, u32 size)
+{
+	Spfcall *nfc;
+
+	conn->nincalls++;
+	if (!conn->freerclist || conn->msize < size)
+		return NULL;
+
+	nfc = conn->freerclist;
+	conn->freerclist = nfc->next;
+	conn->freercnum--;
+	conn->nincalls--;
+	nfc->pkt = (u8*) nfc + sizeof(*nfc);
+	return nfc;
+}
+
 void
 sp_conn_free_incall(Spconn* conn, Spfcall *rc)
 {
@@ -229,12 +463,18 @@ sp_conn_free_incall(Spconn* conn, Spfcall *rc)
 		if (rc == r)
 			abort();
 
-	if (conn->freercnum < 64) {
+	/* keep the cached buffers within half of the memory budget, so
+	   a throttled connection can go under it and read again */
+	if (conn->freercnum < 64 && (!conn->srv->maxmem
+	|| sp_conn_memused(conn) < conn->srv->maxmem/2)) {
 		rc->next = conn->freerclist;
 		conn->freerclist = rc;
+		conn->freercnum++;
 		rc = NULL;
 	}
 
-	if (rc)
+	if (rc) {
 		free(rc);
+		conn->nincalls--;
+	}
 }
@@ -0,0 +1,130 @@
+//
+// CRC32C (Castagnoli), used for the Ethernet frame checksum
+//
+// The SSE4.2 crc32 instruction is used when the CPU has it, otherwise
+// the slice-by-8 tables.
+//
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "spfs.h"
+#include "spfsimpl.h"
+
+#define CRC32C_POLY	0x82f63b78	// reversed
+
+static u32 crc32c_table[8][256];
+static u32 (*crc32c_fn)(u32, const u8 *, int);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void
+sp_crc32c_init_tables(void)
+{
+	int i, j;
+	for (i = 0; i < 256; i++)
+	{
+		u32 crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ?CRC32C_POLY :0);
+		crc32c_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = (crc32c_table[j-1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[j-1][i] & 0xff];
+}
+
+static u32
+sp_crc32c_sw(u32 crc, const u8 *buf, int len)
+{
+	while (len > 0 && ((uintptr_t)buf & 7) != 0)
+	{
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xff];
+		len--;
+	}
+
+	while (len >= 8)
+	{
+		u32 lo, hi;
+		memcpy(&lo, buf, 4);
+		memcpy(&hi, buf + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		lo = __builtin_bswap32(lo);
+		hi = __builtin_bswap32(hi);
+#endif
+		lo ^= crc;
+		crc = crc32c_table[7][lo & 0xff] ^
+			crc32c_table[6][(lo >> 8) & 0xff] ^
+			crc32c_table[5][(lo >> 16) & 0xff] ^
+			crc32c_table[4][lo >> 24] ^
+			crc32c_table[3][hi & 0xff] ^
+			crc32c_table[2][(hi >> 8) & 0xff] ^
+			crc32c_table[1][(hi >> 16) & 0xff] ^
+			crc32c_table[0][hi >> 24];
+		buf += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xff];
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static u32
+sp_crc32c_hw(u32 crc, const u8 *buf, int len)
+{
+	uint64_t crc64 = crc;
+
+	while (len > 0 && ((uintptr_t)buf & 7) != 0)
+	{
+		crc64 = __builtin_ia32_crc32qi(crc64, *buf++);
+		len--;
+	}
+
+	while (len >= 8)
+	{
+		uint64_t v;
+		memcpy(&v, buf, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, v);
+		buf += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0)
+		crc64 = __builtin_ia32_crc32qi(crc64, *buf++);
+
+	return crc64;
+}
+#endif
+
+static void
+sp_crc32c_init(void)
+{
+	sp_crc32c_init_tables();
+	crc32c_fn = sp_crc32c_sw;
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_fn = sp_crc32c_hw;
+#endif
+}
+
+//
+// Continue the CRC of the preceding data, crc is 0 for the first chunk.
+//
+
+u32
+sp_crc32c(u32 crc, u8 *buf, int len)
+{
+	pthread_once(&crc32c_once, sp_crc32c_init);
+
+	return ~crc32c_fn(~crc, buf, len);
+}
+
+//EOF
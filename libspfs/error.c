@@ -29,8 +29,8 @@
 
 char *Enomem = "not enough memory";
 
-static char *sp_ename;
-static int sp_ecode;
+static __thread char *sp_ename;
+static __thread int sp_ecode;
 
 void *
 sp_malloc(int size)
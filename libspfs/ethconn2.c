@@ -35,18 +35,16 @@
 
 #include <arpa/inet.h>
 
-#include <poll.h>
+//
+// All guests share the socket of ethsrv2, the connection only keeps the
+// guest address.
+//
 
 typedef struct Spethconn2 Spethconn2;
 struct Spethconn2 {
 	struct sockaddr_ll saddr;
-	int fd;		// for interface monitoring only
-	Spfd *spfd;
 };
 
-static void sp_ethconn2_notify(Spfd *spfd, void *aux);
-//static int sp_ethconn2_read(Spconn *conn);
-static void sp_ethconn2_write(Spconn *conn);
 static int sp_ethconn2_shutdown(Spconn *conn);
 static void sp_ethconn2_dataout(Spconn *conn, Spreq *req);
 
@@ -62,27 +60,15 @@ sp_ethconn2_create(Spsrv *srv, void *sap)
 		goto error1;
 
 	ethconn->saddr = *(struct sockaddr_ll *)sap;
-	int fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_ALL));
-	if (fd < 0)
-		goto error1;
-
-	if (bind(fd, (struct sockaddr *)&ethconn->saddr, sizeof(ethconn->saddr)) < 0)
-		goto error2;
-
-	ethconn->fd = fd;
-
-	ethconn->spfd = spfd_add(fd, sp_ethconn2_notify, conn);
-	if (!ethconn->spfd)
-		goto error2;
 
 	conn->caux = ethconn;
 	conn->shutdown = sp_ethconn2_shutdown;
 	conn->dataout = sp_ethconn2_dataout;
-	sp_srv_add_conn(srv, conn);
+	if (sp_srv_add_conn(srv, conn) < 0)
+		goto error1;
+
 	return conn;
 
-error2:
-	close(fd);
 error1:
 	sp_conn_destroy(conn);
 	free(ethconn);
@@ -94,8 +80,7 @@ sp_ethconn2_shutdown(Spconn *conn)
 {
 	Spethconn2 *ethconn = conn->caux;
 
-	close(ethconn->fd);
-	spfd_remove(ethconn->spfd);
+	sp_ethsrv2_remove_conn(conn->srv, conn, &ethconn->saddr);
 	free(ethconn);
 
 	return 1;
@@ -106,61 +91,7 @@ sp_ethconn2_dataout(Spconn *conn, Spreq *req)
 {
 	Spethconn2 *ethconn = conn->caux;
 
-	if (req != conn->oreqs)
-		return;
-
-	if (spfd_can_write(ethconn->spfd))
-		sp_ethconn2_write(conn);
-}
-
-static void
-sp_ethconn2_notify(Spfd *spfd, void *aux)
-{
-	int n = 0;
-	Spconn *conn = aux;
-
-	if (spfd_can_write(spfd))
-		sp_ethconn2_write(conn);
-
-	if (n || spfd_has_error(spfd))
-	{
-		if (conn->srv->debuglevel > 0)
-			fprintf(stderr, "sp_ethconn2_notify: error, shutdown conn\n");
-		sp_conn_shutdown(conn);
-	}
-}
-
-static void
-sp_ethconn2_write(Spconn *conn)
-{
-	int n;
-	Spfcall *rc;
-	Spreq *req;
-	//Spsrv *srv = conn->srv;
-	Spethconn2 *ethconn = conn->caux;
-
-	if (!conn->oreqs)
-		return;
-
-	spfd_write(ethconn->spfd, 0, 0);	// reset events
-
-	req = conn->oreqs;
-	rc = req->rcall;
-	if (conn->srv->debuglevel) {
-		fprintf(stderr, ">>> (%p) ", conn);
-		sp_printfcall(stderr, rc, conn->dotu);
-		fprintf(stderr, "\n");
-	}
-
-	n = sendto(ethconn->fd, rc->pkt, rc->size, 0,
-			(struct sockaddr *)&ethconn->saddr, sizeof(ethconn->saddr));
-	if (n <= 0)
-		return;
-
-	conn->oreqs = req->next;
-	sp_conn_free_incall(conn, req->tcall);
-	sp_req_free(req);
-	free(rc);
+	sp_ethsrv2_dataout(conn->srv, conn, &ethconn->saddr);
 }
 
 //EOF
@@ -0,0 +1,303 @@
+//
+// Framing of 9P messages on raw Ethernet
+//
+// A plain frame carries a whole 9P message followed by the 4-byte csum
+// field. Messages that don't fit in a frame are split into fragments, each
+// starting with a header:
+//
+//	magic[4] tag[2] flags[2] offset[4] total[4]
+//
+// all little endian. The size field that starts a plain frame never has
+// the top byte set, so the magic tells the two formats apart. tag is the
+// 9P tag of the message, offset is where the fragment data goes and total
+// is the size of the whole message.
+//
+// With the ETHFRAME_REL flag the header continues with
+//
+//	seq[4] ack[4]
+//
+// seq numbers the messages (not the fragments) of each direction, ack is
+// the last message received in order from the other side. ETHFRAME_ACK
+// frames carry only the ack (total is 0), ETHFRAME_SYN marks the first
+// message of a new session.
+//
+// With ETHFRAME_CRED the header continues (after seq and ack, if any) with
+//
+//	credit[4]
+//
+// In the responses it is the number of requests the guest may have
+// outstanding, the guest sets the flag to ask for it and leaves the field
+// 0. Guests that don't ask aren't limited.
+//
+// With ETHFRAME_PACK the data is several whole messages back to back,
+// each delimited by its own size field. tag is the number of messages,
+// offset is 0 and total is the size of all of them. With ETHFRAME_REL seq
+// is that of the first message, the others follow in order. The server
+// packs its responses once the guest sends a packed frame.
+//
+// With ETHFRAME_CSUM the csum field at the end of the frame is the CRC32C
+// of the header and the data. Guests that never set it get no checksums
+// either.
+//
+
+#include <string.h>
+
+#include "spfs.h"
+#include "spfsimpl.h"
+
+static u32
+getu32(u8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+}
+
+static void
+putu32(u8 *p, u32 v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+//
+// Parse the frame (without the csum field), returns 0 for a plain frame,
+// 1 for a fragment and -1 if the frame is malformed.
+//
+
+int
+sp_ethframe_parse(u8 *buf, int len, Ethframe *f)
+{
+	if (len < 4)
+		return -1;
+
+	if (getu32(buf) != ETHFRAME_MAGIC)
+	{
+		if (getu32(buf) != len)
+			return -1;
+
+		f->tag = buf[5] | (buf[6] << 8);
+		f->flags = 0;
+		f->offset = 0;
+		f->total = len;
+		f->seq = 0;
+		f->ack = 0;
+		f->credit = 0;
+		f->data = buf;
+		f->count = len;
+		return 0;
+	}
+
+	if (len < ETHFRAME_HDRSZ)
+		return -1;
+
+	f->tag = buf[4] | (buf[5] << 8);
+	f->flags = buf[6] | (buf[7] << 8);
+	f->offset = getu32(buf + 8);
+	f->total = getu32(buf + 12);
+	f->seq = 0;
+	f->ack = 0;
+	f->credit = 0;
+
+	int hdrsz = ETHFRAME_HDRSZ;
+	if (f->flags & ETHFRAME_REL)
+	{
+		if (len < ETHFRAME_RELHDRSZ)
+			return -1;
+
+		f->seq = getu32(buf + 16);
+		f->ack = getu32(buf + 20);
+		hdrsz = ETHFRAME_RELHDRSZ;
+	}
+
+	if (f->flags & ETHFRAME_CRED)
+	{
+		if (len < hdrsz + 4)
+			return -1;
+
+		f->credit = getu32(buf + hdrsz);
+		hdrsz += 4;
+	}
+
+	f->data = buf + hdrsz;
+	f->count = len - hdrsz;
+
+	if (f->flags & ETHFRAME_ACK)
+		return (f->flags & ETHFRAME_REL) ?1 :-1;
+
+	if (f->total < 7 || f->offset > f->total || f->count > f->total - f->offset)
+		return -1;
+
+	if ((f->flags & ETHFRAME_PACK) && (f->offset != 0 || f->count != f->total))
+		return -1;
+
+	return 1;
+}
+
+// returns the size of the header
+int
+sp_ethframe_put(u8 *buf, Ethframe *f)
+{
+	putu32(buf, ETHFRAME_MAGIC);
+	buf[4] = f->tag;
+	buf[5] = f->tag >> 8;
+	buf[6] = f->flags;
+	buf[7] = f->flags >> 8;
+	putu32(buf + 8, f->offset);
+	putu32(buf + 12, f->total);
+
+	int hdrsz = ETHFRAME_HDRSZ;
+	if (f->flags & ETHFRAME_REL)
+	{
+		putu32(buf + 16, f->seq);
+		putu32(buf + 20, f->ack);
+		hdrsz = ETHFRAME_RELHDRSZ;
+	}
+
+	if (f->flags & ETHFRAME_CRED)
+	{
+		putu32(buf + hdrsz, f->credit);
+		hdrsz += 4;
+	}
+
+	return hdrsz;
+}
+
+//
+// Add a fragment to the messages being reassembled for the connection.
+// Returns the incall once the whole message is in, NULL otherwise. If all
+// slots are busy the oldest partial message is dropped.
+//
+
+//
+// Add the bytes [start, end) of a fragment to the ones received. Returns
+// -1 if the fragment is empty, repeats or overlaps one received already,
+// e.g. a retransmission, or there are too many gaps to keep track of; it
+// is dropped then.
+//
+
+static int
+sp_ethframe_addrange(Ethrasm *r, u32 start, u32 end)
+{
+	int i;
+
+	if (start >= end)
+		return -1;
+
+	for (i = 0; i < r->nranges; i++)
+		if (r->start[i] < end && start < r->end[i])
+			return -1;
+
+	// the first range that doesn't end before the fragment
+	for (i = 0; i < r->nranges && r->end[i] < start; i++)
+		;
+
+	if (i < r->nranges && r->end[i] == start)
+	{
+		r->end[i] = end;
+		if (i + 1 < r->nranges && r->start[i + 1] == end)
+		{
+			r->end[i] = r->end[i + 1];
+			r->nranges--;
+			memmove(&r->start[i + 1], &r->start[i + 2], (r->nranges - i - 1) * sizeof(u32));
+			memmove(&r->end[i + 1], &r->end[i + 2], (r->nranges - i - 1) * sizeof(u32));
+		}
+		return 0;
+	}
+
+	if (i < r->nranges && r->start[i] == end)
+	{
+		r->start[i] = start;
+		return 0;
+	}
+
+	if (r->nranges == ETHRASM_NRANGES)
+		return -1;
+
+	memmove(&r->start[i + 1], &r->start[i], (r->nranges - i) * sizeof(u32));
+	memmove(&r->end[i + 1], &r->end[i], (r->nranges - i) * sizeof(u32));
+	r->start[i] = start;
+	r->end[i] = end;
+	r->nranges++;
+	return 0;
+}
+
+Spfcall *
+sp_ethframe_reassemble(Spconn *conn, Ethrasm *rasm, int nrasm, Ethframe *f)
+{
+	if (f->total > conn->msize)
+		return NULL;
+
+	Ethrasm *r = 0;
+	Ethrasm *oldest = 0;
+	int i;
+	for (i = 0; i < nrasm; i++)
+	{
+		if (rasm[i].fc == 0)
+		{
+			if (r == 0)
+				r = &rasm[i];
+			continue;
+		}
+
+		if (rasm[i].tag == f->tag && rasm[i].total == f->total)
+		{
+			r = &rasm[i];
+			break;
+		}
+
+		if (oldest == 0 || rasm[i].stamp < oldest->stamp)
+			oldest = &rasm[i];
+	}
+
+	if (r == 0)
+	{
+		sp_conn_free_incall(conn, oldest->fc);
+		oldest->fc = 0;
+		r = oldest;
+	}
+
+	if (r->fc == 0)
+	{
+		r->fc = sp_conn_new_incall(conn);
+		if (r->fc == 0)
+			return NULL;
+
+		r->tag = f->tag;
+		r->total = f->total;
+		r->nranges = 0;
+	}
+
+	static __thread u32 stamp;
+	r->stamp = ++stamp;
+
+	if (sp_ethframe_addrange(r, f->offset, f->offset + f->count) < 0)
+		return NULL;
+
+	memcpy(r->fc->pkt + f->offset, f->data, f->count);
+	if (r->nranges != 1 || r->start[0] != 0 || r->end[0] != r->total)
+		return NULL;
+
+	Spfcall *fc = r->fc;
+	r->fc = 0;
+	if (getu32(fc->pkt) != r->total)
+	{
+		sp_conn_free_incall(conn, fc);
+		return NULL;
+	}
+
+	return fc;
+}
+
+void
+sp_ethframe_reset(Spconn *conn, Ethrasm *rasm, int nrasm)
+{
+	int i;
+	for (i = 0; i < nrasm; i++)
+	{
+		sp_conn_free_incall(conn, rasm[i].fc);
+		rasm[i].fc = 0;
+	}
+}
+
+//EOF
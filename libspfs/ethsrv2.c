@@ -1,7 +1,10 @@
 //
-//
+// 9P on raw Ethernet, one packet socket for all guests on all the served
+// interfaces. The interfaces are tracked with netlink, guests are told
+// apart by the interface and the MAC.
 //
 
+#define _GNU_SOURCE	// sendmmsg
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
@@ -9,88 +12,639 @@
 #include <string.h>
 #include <errno.h>
 
-#include <netpacket/packet.h>
+#include <linux/if_packet.h>	// TPACKET_V3 isn't in netpacket/packet.h
 #include <net/ethernet.h>
 
+#include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <net/if.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <fnmatch.h>
 
 #include <arpa/inet.h>
+#include <time.h>
 
 #include "spfs.h"
 #include "spfsimpl.h"
 
 typedef struct Ethsrv2 Ethsrv2;
+typedef struct Ethaddr Ethaddr;
+typedef struct Ethtx Ethtx;
+typedef struct Ethif Ethif;
+
+#define ETHSRV2_HTABLE_SIZE	64
+
+// guests have Xen MACs, 00:16:3e:xx:xx:xx
+#define ETHSRV2_OUI		0x00163e
+
+// PACKET_RX_RING geometry, a block holds a few maximum size frames
+#define ETHSRV2_RING_BSIZE	(1 << 17)
+#define ETHSRV2_RING_FSIZE	2048
+#define ETHSRV2_RING_TIMEOUT	2	// msec before a partial block is retired
+
+// large messages are fragmented, so msize isn't limited by the MTU
+#define ETHSRV2_MSIZE		(32*1024 + IOHDRSZ)
+
+// messages of a guest that can be reassembled at the same time
+#define ETHSRV2_NRASM		4
+
+// maximum number of frames passed to a single sendmmsg()/recvmmsg()
+#define ETHSRV2_TXBATCH		64
+#define ETHSRV2_RXBATCH		64
+
+// responses of a guest being sent, or kept until acked if the guest
+// asked for reliable delivery
+#define ETHSRV2_TXWINDOW	32
+
+// retransmit timeout in msec, doubled on each try
+#define ETHSRV2_RTO		50
+#define ETHSRV2_RTO_TICK	20
+#define ETHSRV2_MAXTRIES	8
+
+// credits, the requests a guest may have outstanding
+#define ETHSRV2_CREDIT_TICK	100	// msec between recomputing them
+#define ETHSRV2_MAXCREDIT	64
+
+// most responses packed in one frame
+#define ETHSRV2_MAXPACK		16
+
+struct Ethtx {
+	Spfcall *rc;
+	u16 tag;
+	u32 seq;
+	u32 off;		// sent so far
+	long long stamp;	// msec, when last sent completely
+	int tries;
+};
+
+struct Ethif {
+	int ifindex;
+	int mtu;
+	Ethif *next;
+};
+
+struct Ethaddr {
+	uint8_t haddr[ETH_ALEN];
+	Spconn *conn;
+	Ethaddr *next;
 
-#define MAX_CONNS	256
+	struct sockaddr_ll saddr;	// where the responses go, incl. the interface
+	int mtu;
+	int txpending;
+	Ethaddr *txnext;
+
+	Ethrasm rasm[ETHSRV2_NRASM];
+
+	Ethtx tx[ETHSRV2_TXWINDOW];
+	int txfirst;
+	int ntx;
+
+	int csum;		// the guest checksums its frames
+	int pack;		// the guest packs its messages
+	int reliable;		// the guest uses ETHFRAME_REL frames
+	u32 synseq;
+	u32 sndnxt;		// seq of the next response
+	u32 rcvbase;		// all requests before it were received
+	uint64_t rcvmask;	// requests received from rcvbase on
+	Ethaddr *relnext;
+
+	int credited;		// the guest asked for credits
+	u32 credit;		// last advertised
+	u32 climit;		// requests accepted, >= credit until it is in use
+	int nrecv;		// requests during the current credit tick
+};
 
 struct Ethsrv2 {
 	int fd;
 	Spfd *spfd;
+	Spfd *txspfd;		// where the responses go, spfd or xspfd
 
-	struct {
-		uint8_t haddr[ETH_ALEN];
-		Spconn *conn;
-	} addr_to_conn[MAX_CONNS];
+	char *ifpat;		// interfaces served, a shell pattern
+	int ifindex;		// if it matches just one name, 0 otherwise
+	Ethif *ifs;		// the interfaces that match now
+	int nlfd;		// netlink socket, interfaces coming and going
+	Spfd *nlspfd;
+
+	Ethaddr **htable;	// connections hashed by the guest MAC
+	int hsize;
 	int nr_conns;
+
+	Ethaddr *txhead;	// guests with responses waiting to be sent
+	Ethaddr *txtail;
+	int innotify;
+
+	Ethaddr *rel;		// guests using reliable delivery
+	Sptimer *rtimer;
+
+	int credits;		// requests the socket buffer can hold
+	int ncredited;		// guests that asked for credits
+	u32 share;		// credit of each guest
+	long long cstamp;	// when it was computed
+
+	Spfcall *rxpool[ETHSRV2_RXBATCH];	// recvmmsg() buffers
+
+	uint8_t *ring;		// TPACKET_V3 receive ring, if enabled
+	int ring_bsize;
+	int ring_bnum;
+	int ring_cur;
+
+	Ethxdp *xdp;		// AF_XDP socket, if enabled
+	Spfd *xspfd;
 };
 
 static void sp_ethsrv2_notify(Spfd *spfd, void *aux);
+static void sp_ethsrv2_notify_xdp(Spfd *spfd, void *aux);
 static void sp_ethsrv2_start(Spsrv *srv);
 static void sp_ethsrv2_shutdown(Spsrv *srv);
 static void sp_ethsrv2_destroy(Spsrv *srv);
 
+static Ethif *
+sp_ethsrv2_find_if(Ethsrv2 *es, int ifindex)
+{
+	// guests are looked up first, this is only done when one connects
+	Ethif *ifp;
+	for (ifp = es->ifs; ifp != 0; ifp = ifp->next)
+		if (ifp->ifindex == ifindex)
+			return ifp;
+
+	return 0;
+}
+
+static void
+sp_ethsrv2_free_ifs(Ethsrv2 *es)
+{
+	while (es->ifs != 0)
+	{
+		Ethif *ifp = es->ifs;
+		es->ifs = ifp->next;
+		free(ifp);
+	}
+}
+
+//
+// The interface is gone, or doesn't match any more. Its guests are
+// disconnected right away instead of waiting for the idle timeout.
+//
+
+static void
+sp_ethsrv2_remove_if(Ethsrv2 *es, int ifindex)
+{
+	Ethif **pifp;
+	for (pifp = &es->ifs; *pifp != 0; pifp = &(*pifp)->next)
+	{
+		Ethif *ifp = *pifp;
+		if (ifp->ifindex == ifindex)
+		{
+			*pifp = ifp->next;
+			free(ifp);
+			break;
+		}
+	}
+
+	int n = 0;
+	int i;
+	for (i = 0; i < es->hsize; i++)
+	{
+		Ethaddr *ea = es->htable[i];
+		while (ea != 0)
+		{
+			// the shutdown frees ea, but nothing else in the chain
+			Ethaddr *next = ea->next;
+			if (ea->saddr.sll_ifindex == ifindex &&
+			    (ea->conn->flags & Cshutdown) == 0)
+			{
+				sp_conn_shutdown(ea->conn);
+				n++;
+			}
+			ea = next;
+		}
+	}
+
+	fprintf(stderr, "Interface %d removed, %d connections closed\n", ifindex, n);
+}
+
+static void
+sp_ethsrv2_link(Ethsrv2 *es, struct nlmsghdr *nh)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	char *name = 0;
+	int mtu = 0;
+
+	struct rtattr *rta = IFLA_RTA(ifi);
+	int len = IFLA_PAYLOAD(nh);
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+	{
+		if (rta->rta_type == IFLA_IFNAME)
+			name = RTA_DATA(rta);
+		else if (rta->rta_type == IFLA_MTU && RTA_PAYLOAD(rta) == 4)
+			mtu = *(u32 *)RTA_DATA(rta);
+	}
+
+	Ethif *ifp = sp_ethsrv2_find_if(es, ifi->ifi_index);
+	int match = nh->nlmsg_type == RTM_NEWLINK && name != 0 &&
+		fnmatch(es->ifpat, name, 0) == 0 &&
+		(es->ifindex == 0 || es->ifindex == ifi->ifi_index);
+
+	if (!match)
+	{
+		if (ifp != 0)
+			sp_ethsrv2_remove_if(es, ifi->ifi_index);
+		return;
+	}
+
+	if (ifp == 0)
+	{
+		ifp = malloc(sizeof(*ifp));
+		if (ifp == 0)
+			return;
+
+		ifp->ifindex = ifi->ifi_index;
+		ifp->next = es->ifs;
+		es->ifs = ifp;
+		fprintf(stderr, "Serving interface %s\n", name);
+	}
+
+	// guests that are connected keep the old one
+	if (mtu > 0)
+		ifp->mtu = mtu;
+}
+
+//
+// Handle the netlink messages queued. Returns 1 at the end of a dump, -1
+// on error and 0 otherwise.
+//
+
+static int
+sp_ethsrv2_read_nl(Ethsrv2 *es, int flags)
+{
+	u8 buf[16384];
+	int done = 0;
+
+	for (;;)
+	{
+		int len = recv(es->nlfd, buf, sizeof(buf), flags);
+		if (len < 0)
+			return (errno == EAGAIN || errno == EINTR) ?done :-1;
+
+		struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+		for (; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len))
+		{
+			if (nh->nlmsg_type == NLMSG_DONE)
+				done = 1;
+			else if (nh->nlmsg_type == NLMSG_ERROR)
+				return -1;
+			else if (nh->nlmsg_type == RTM_NEWLINK ||
+				 nh->nlmsg_type == RTM_DELLINK)
+				sp_ethsrv2_link(es, nh);
+		}
+
+		if (done || !(flags & MSG_DONTWAIT))
+			return done;
+	}
+}
+
+static void
+sp_ethsrv2_notify_nl(Spfd *spfd, void *aux)
+{
+	Spsrv *srv = aux;
+	Ethsrv2 *es = srv->srvaux;
+
+	if (!spfd_can_read(spfd))
+		return;
+
+	spfd_read(spfd, 0, 0);	// reset POLLIN event
+	if (sp_ethsrv2_read_nl(es, MSG_DONTWAIT) < 0 && srv->debuglevel > 0)
+		fprintf(stderr, "sp_ethsrv2_notify_nl: %d\n", errno);
+}
+
+//
+// Serve the interfaces with names matching ifpat, e.g. a single name or
+// "vif*" for all Xen vifs. Interfaces are picked up as they are created,
+// the guests on removed interfaces are disconnected.
+//
+
 Spsrv*
-sp_ethsrv2_create(char *ifname)
+sp_ethsrv2_create(char *ifpat)
 {
 	struct Ethsrv2 *es = malloc(sizeof(*es));
 	if (es == NULL)
 		return NULL;
 
-	es->fd = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_ALL));
-	if (es->fd < 0)
+	es->ifs = 0;
+	es->nlfd = -1;
+	es->ifpat = strdup(ifpat);
+	if (es->ifpat == 0)
 		goto error1;
 
-	struct ifreq ifr;
-	memset(&ifr, 0, sizeof(ifr));
-	strcpy(ifr.ifr_name, ifname);
-	if (ioctl(es->fd, SIOCGIFINDEX, &ifr) < 0)
+	// with protocol 0 nothing is queued to the socket until the bind()
+	es->fd = socket(AF_PACKET, SOCK_DGRAM, 0);
+	if (es->fd < 0)
+		goto error4;
+
+	//
+	// Let the kernel drop the frames that aren't for us before they are
+	// queued to the socket. It is in place before the bind() starts the
+	// delivery, so none slip through. The socket is SOCK_DGRAM, the
+	// source MAC is reached through the link layer offset.
+	//
+
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, EXP_9P_ETH, 0, 4),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_LL_OFF + ETH_ALEN),
+		BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xffffff00),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHSRV2_OUI << 8, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog fprog = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+	if (setsockopt(es->fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0)
 		goto error2;
 
+	// a plain name must exist already
+	es->ifindex = 0;
+	if (strpbrk(ifpat, "*?[") == 0)
+	{
+		es->ifindex = if_nametoindex(ifpat);
+		if (es->ifindex == 0)
+			goto error2;
+	}
+
+	// the interface is checked when a guest connects
 	struct sockaddr_ll saddr = {
 		.sll_family = AF_PACKET,
 		.sll_protocol = htons(EXP_9P_ETH),
-		.sll_ifindex = ifr.ifr_ifindex,
+		.sll_ifindex = es->ifindex,
 	};
 	if (bind(es->fd, (struct sockaddr *)&saddr, sizeof(saddr)) < 0)
 		goto error2;
 
+	// roughly what a frame takes in the socket buffer
+	int rcvbuf;
+	socklen_t optlen = sizeof(rcvbuf);
+	if (getsockopt(es->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen) < 0)
+		goto error2;
+	es->credits = rcvbuf / ETHSRV2_RING_FSIZE;
+	es->ncredited = 0;
+	es->share = es->credits < ETHSRV2_MAXCREDIT ?es->credits :ETHSRV2_MAXCREDIT;
+	es->cstamp = 0;
+
 	es->nr_conns = 0;
+	es->txhead = 0;
+	es->txtail = 0;
+	es->innotify = 0;
+	es->rel = 0;
+	es->rtimer = 0;
+	memset(es->rxpool, 0, sizeof(es->rxpool));
+	es->ring = 0;
+	es->ring_bsize = 0;
+	es->ring_bnum = 0;
+	es->ring_cur = 0;
+	es->xdp = 0;
+	es->xspfd = 0;
+	es->hsize = ETHSRV2_HTABLE_SIZE;
+	es->htable = calloc(es->hsize, sizeof(Ethaddr *));
+	if (es->htable == 0)
+		goto error2;
+
+	es->nlfd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_ROUTE);
+	if (es->nlfd < 0)
+		goto error3;
+
+	struct sockaddr_nl nladdr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_LINK,
+	};
+	if (bind(es->nlfd, (struct sockaddr *)&nladdr, sizeof(nladdr)) < 0)
+		goto error3;
+
+	//
+	// Get the interfaces there are now. The changes are multicast from
+	// the bind() on, so none are missed.
+	//
+
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifi;
+	} req;
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = sizeof(req);
+	req.nh.nlmsg_type = RTM_GETLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.ifi.ifi_family = AF_UNSPEC;
+	if (send(es->nlfd, &req, sizeof(req), 0) < 0)
+		goto error3;
+
+	int done;
+	while ((done = sp_ethsrv2_read_nl(es, 0)) == 0)
+		;
+	if (done < 0)
+		goto error3;
 
 	Spsrv *srv = sp_srv_create();
 	if (srv == 0)
-		goto error2;
+		goto error3;
 
 	srv->srvaux = es;
+	srv->msize = ETHSRV2_MSIZE;
 	srv->start = sp_ethsrv2_start;
 	srv->shutdown = sp_ethsrv2_shutdown;
 	srv->destroy = sp_ethsrv2_destroy;
 
 	return srv;
 
+error3:
+	sp_ethsrv2_free_ifs(es);
+	free(es->htable);
+	if (es->nlfd >= 0)
+		close(es->nlfd);
 error2:
 	close(es->fd);
+error4:
+	free(es->ifpat);
 error1:
 	free(es);
 	return NULL;
 }
 
+//
+// Switch the socket to a TPACKET_V3 mmap ring of nblocks blocks. Must be
+// called before sp_srv_start(). The frames are then read in batches
+// directly from the shared memory instead of a recvfrom() per frame.
+//
+
+int
+sp_ethsrv2_set_rxring(Spsrv *srv, int nblocks)
+{
+	Ethsrv2 *es = srv->srvaux;
+
+	int bsize = ETHSRV2_RING_BSIZE;
+	while (bsize < srv->msize + ETHSRV2_RING_FSIZE)
+		bsize <<= 1;
+
+	int ver = TPACKET_V3;
+	if (setsockopt(es->fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0)
+	{
+		sp_suerror("cannot set TPACKET_V3", errno);
+		return -1;
+	}
+
+	struct tpacket_req3 req;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = bsize;
+	req.tp_block_nr = nblocks;
+	req.tp_frame_size = ETHSRV2_RING_FSIZE;
+	req.tp_frame_nr = (bsize / ETHSRV2_RING_FSIZE) * nblocks;
+	req.tp_retire_blk_tov = ETHSRV2_RING_TIMEOUT;
+	if (setsockopt(es->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+	{
+		sp_suerror("cannot set PACKET_RX_RING", errno);
+		return -1;
+	}
+
+	void *ring = mmap(0, bsize * nblocks, PROT_READ | PROT_WRITE,
+			MAP_SHARED, es->fd, 0);
+	if (ring == MAP_FAILED)
+	{
+		sp_suerror("cannot map PACKET_RX_RING", errno);
+		return -1;
+	}
+
+	es->ring = ring;
+	es->ring_bsize = bsize;
+	es->ring_bnum = nblocks;
+	es->ring_cur = 0;
+
+	return 0;
+}
+
+//
+// Receive and send the frames through an AF_XDP socket bound to queue of
+// the interface. Must be called before sp_srv_start(). Frames that arrive
+// on the other queues still come through the packet socket.
+//
+
+int
+sp_ethsrv2_set_xdp(Spsrv *srv, int queue, int flags)
+{
+	Ethsrv2 *es = srv->srvaux;
+
+	Ethif *ifp = sp_ethsrv2_find_if(es, es->ifindex);
+	if (ifp == 0)
+	{
+		sp_werror("AF_XDP needs a single interface", EINVAL);
+		return -1;
+	}
+
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	if (if_indextoname(es->ifindex, ifr.ifr_name) == 0 ||
+	    ioctl(es->fd, SIOCGIFHWADDR, &ifr) < 0)
+	{
+		sp_suerror("cannot get the interface address", errno);
+		return -1;
+	}
+
+	Ethxdp *xdp = sp_ethxdp_create(es->ifindex, queue,
+			(u8 *)ifr.ifr_hwaddr.sa_data, EXP_9P_ETH, flags);
+	if (xdp == 0)
+		return -1;
+
+	if (ifp->mtu > sp_ethxdp_maxframe(xdp))
+	{
+		sp_ethxdp_destroy(xdp);
+		sp_werror("MTU too large for AF_XDP", EINVAL);
+		return -1;
+	}
+
+	es->xdp = xdp;
+	return 0;
+}
+
+//
+// Join the socket to fanout group id. Each socket of the group belongs to
+// a server running its own loop, usually in its own thread, the kernel
+// spreads the frames between them by a hash of the guest MAC so that all
+// frames of a guest reach the same server. The flow hash of
+// PACKET_FANOUT_HASH doesn't cover the MAC for our EtherType, so the
+// hash is a classic BPF program.
+//
+
+int
+sp_ethsrv2_set_fanout(Spsrv *srv, int id)
+{
+	Ethsrv2 *es = srv->srvaux;
+
+	int arg = (id & 0xffff) | (PACKET_FANOUT_CBPF << 16);
+	if (setsockopt(es->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0)
+	{
+		sp_suerror("cannot join the fanout group", errno);
+		return -1;
+	}
+
+	// (last 4 bytes of the source MAC) folded, the kernel takes it modulo
+	// the number of sockets
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_LL_OFF + ETH_ALEN + 2),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog fprog = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+	if (setsockopt(es->fd, SOL_PACKET, PACKET_FANOUT_DATA, &fprog, sizeof(fprog)) < 0)
+	{
+		sp_suerror("cannot set the fanout program", errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+//
+// Let the kernel busy poll the device queue for usec when the socket is
+// polled with nothing to read, where the driver supports it. Meant for a
+// loop that spins itself, see sp_poll_set_busypoll.
+//
+
+int
+sp_ethsrv2_set_busypoll(Spsrv *srv, int usec)
+{
+	Ethsrv2 *es = srv->srvaux;
+
+	int on = 1;
+	if (setsockopt(es->fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0 ||
+	    setsockopt(es->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0)
+	{
+		sp_suerror("cannot set SO_BUSY_POLL", errno);
+		return -1;
+	}
+
+	return 0;
+}
+
 static void
 sp_ethsrv2_start(Spsrv *srv)
 {
 	Ethsrv2 *es = srv->srvaux;
 
 	es->spfd = spfd_add(es->fd, sp_ethsrv2_notify, srv);
+	es->txspfd = es->spfd;
+	es->nlspfd = spfd_add(es->nlfd, sp_ethsrv2_notify_nl, srv);
+	if (es->xdp != 0)
+	{
+		es->xspfd = spfd_add(sp_ethxdp_fd(es->xdp), sp_ethsrv2_notify_xdp, srv);
+		es->txspfd = es->xspfd;
+	}
 }
 
 static void
@@ -99,6 +653,24 @@ sp_ethsrv2_shutdown(Spsrv *srv)
 	Ethsrv2 *es = srv->srvaux;
 
 	spfd_remove(es->spfd);
+	spfd_remove(es->nlspfd);
+	close(es->nlfd);
+	if (es->rtimer != 0)
+	{
+		sp_timer_remove(es->rtimer);
+		es->rtimer = 0;
+	}
+	if (es->ring != 0)
+	{
+		munmap(es->ring, es->ring_bsize * es->ring_bnum);
+		es->ring = 0;
+	}
+	if (es->xdp != 0)
+	{
+		spfd_remove(es->xspfd);
+		sp_ethxdp_destroy(es->xdp);
+		es->xdp = 0;
+	}
 	close(es->fd);
 }
 
@@ -107,108 +679,1241 @@ sp_ethsrv2_destroy(Spsrv *srv)
 {
 	Ethsrv2 *es = srv->srvaux;
 
+	int i;
+	for (i = 0; i < es->hsize; i++)
+	{
+		Ethaddr *ea = es->htable[i];
+		while (ea != 0)
+		{
+			Ethaddr *next = ea->next;
+			free(ea);
+			ea = next;
+		}
+	}
+
+	for (i = 0; i < ETHSRV2_RXBATCH; i++)
+		free(es->rxpool[i]);
+
+	sp_ethsrv2_free_ifs(es);
+	free(es->ifpat);
+	free(es->htable);
 	free(es);
 	srv->srvaux = NULL;
 }
 
-static void
-sp_ethsrv2_notify(Spfd *spfd, void *aux)
+static unsigned int
+sp_ethsrv2_hash(Ethsrv2 *es, struct sockaddr_ll *sap)
 {
-	Spsrv *srv = aux;
-	Ethsrv2 *es = srv->srvaux;
-
-	Spfcall *fc;
-	Spreq *req;
-
-	if (!spfd_can_read(spfd))
-		return;
-
-	if (srv->enomem)
-		return;
+	// FNV-1a over the full MAC and the interface
+	unsigned int h = 2166136261u;
+	int i;
+	for (i = 0; i < ETH_ALEN; i++)
+		h = (h ^ sap->sll_addr[i]) * 16777619u;
+	for (i = 0; i < 4; i++)
+		h = (h ^ ((sap->sll_ifindex >> (8*i)) & 0xff)) * 16777619u;
 
-	spfd_read(spfd, 0, 0);	// reset POLLIN event
+	return h & (es->hsize -1);
+}
 
-	struct sockaddr_ll saddr;
-	socklen_t sa_len = sizeof(saddr);
+static Ethaddr *
+sp_ethsrv2_find_addr(Ethsrv2 *es, struct sockaddr_ll *sap)
+{
+	Ethaddr *ea;
+	for (ea = es->htable[sp_ethsrv2_hash(es, sap)]; ea != 0; ea = ea->next)
+		if (ea->saddr.sll_ifindex == sap->sll_ifindex &&
+		    memcmp(ea->haddr, sap->sll_addr, ETH_ALEN) == 0)
+			return ea;
 
-	uint8_t buf[srv->msize];
-	int len = recvfrom(es->fd, buf, srv->msize, 0,
-			(struct sockaddr *)&saddr, &sa_len);
-	if (len < 0)
-		return;
+	return 0;
+}
 
-	if (len < 4)
-		return;
-	int exp_len = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
-	if (exp_len != len -4)	// -4: csum field
-	{
-		fprintf(stderr, "sp_ethsrv2_notify: bad exp len %d vs %d\n", exp_len, len -4);
-		return;
-	}
+static void
+sp_ethsrv2_grow(Ethsrv2 *es)
+{
+	Ethaddr **old = es->htable;
+	int oldsize = es->hsize;
 
-	uint8_t mac1 = saddr.sll_addr[0];
-	uint8_t mac2 = saddr.sll_addr[1];
-	uint8_t mac3 = saddr.sll_addr[2];
-	uint8_t mac4 = saddr.sll_addr[3];
-	uint8_t mac5 = saddr.sll_addr[4];
-	uint8_t mac6 = saddr.sll_addr[5];
+	Ethaddr **htable = calloc(oldsize *2, sizeof(Ethaddr *));
+	if (htable == 0)
+		return;		// keep the old table, chains just get longer
 
-	if (mac1 != 0x00 || mac2 != 0x16 || mac3 != 0x3e)
-		return;
+	es->htable = htable;
+	es->hsize = oldsize *2;
 
-	Spconn *conn = 0;
 	int i;
-	for (i = 0; i < es->nr_conns; i++)
+	for (i = 0; i < oldsize; i++)
 	{
-		if (mac4 == es->addr_to_conn[i].haddr[3] &&
-			mac5 == es->addr_to_conn[i].haddr[4] &&
-			mac6 == es->addr_to_conn[i].haddr[5])
+		Ethaddr *ea = old[i];
+		while (ea != 0)
 		{
-			conn = es->addr_to_conn[i].conn;
-			break;
+			Ethaddr *next = ea->next;
+			unsigned int h = sp_ethsrv2_hash(es, &ea->saddr);
+			ea->next = es->htable[h];
+			es->htable[h] = ea;
+			ea = next;
 		}
 	}
 
-	if (conn == 0)
-	{
-		assert(es->nr_conns < MAX_CONNS);
+	free(old);
+}
 
-		//
-		// An unknown client sends the first message; create a new connection.
-		//
-		
-		conn = sp_ethconn2_create(srv, &saddr);
+static Ethaddr *
+sp_ethsrv2_add_conn(Ethsrv2 *es, struct sockaddr_ll *sap, Ethif *ifp, Spconn *conn)
+{
+	uint8_t *haddr = sap->sll_addr;
 
-		memcpy(es->addr_to_conn[es->nr_conns].haddr, saddr.sll_addr, ETH_ALEN);
-		es->addr_to_conn[es->nr_conns].conn = conn;
-		es->nr_conns++;
+	Ethaddr *ea = malloc(sizeof(*ea));
+	if (ea == 0)
+		return 0;
 
-		fprintf(stderr, "A new connection to %02x:%02x:%02x:%02x:%02x:%02x added\n",
-									mac1, mac2, mac3, mac4, mac5, mac6);
-	}
+	if (es->nr_conns >= es->hsize)
+		sp_ethsrv2_grow(es);
 
-	fc = sp_conn_new_incall(conn);
-	if (fc == 0)
-		return;
-	req = sp_req_alloc(conn, fc);
-	if (req == 0)
-		return;
-	fc = req->tcall;
+	unsigned int h = sp_ethsrv2_hash(es, sap);
+	memcpy(ea->haddr, haddr, ETH_ALEN);
+	ea->conn = conn;
+	ea->saddr = *sap;
+	ea->mtu = ifp->mtu;
+	ea->txpending = 0;
+	ea->txnext = 0;
+	memset(ea->rasm, 0, sizeof(ea->rasm));
+	memset(ea->tx, 0, sizeof(ea->tx));
+	ea->txfirst = 0;
+	ea->ntx = 0;
+	ea->csum = 0;
+	ea->pack = 0;
+	ea->reliable = 0;
+	ea->synseq = 0;
+	ea->sndnxt = 0;
+	ea->rcvbase = 0;
+	ea->rcvmask = 0;
+	ea->relnext = 0;
+	ea->credited = 0;
+	ea->credit = 0;
+	ea->climit = 0;
+	ea->nrecv = 0;
+	ea->next = es->htable[h];
+	es->htable[h] = ea;
+	es->nr_conns++;
 
-	if (sp_deserialize(fc, buf, conn->dotu) == 0)
-   	{
-		fprintf(stderr, "error while deserializing\n");
-		return;
-	}
+	return ea;
+}
 
-	if (srv->debuglevel > 0)
+static void
+sp_ethsrv2_tx_unlink(Ethsrv2 *es, Ethaddr *ea)
+{
+	Ethaddr *prev = 0;
+	Ethaddr *p;
+	for (p = es->txhead; p != 0; prev = p, p = p->txnext)
 	{
-		fprintf(stderr, "<<< (%p) ", conn);
-		sp_printfcall(stderr, fc, conn->dotu);
-		fprintf(stderr, "\n");
+		if (p != ea)
+			continue;
+
+		if (prev != 0)
+			prev->txnext = ea->txnext;
+		else
+			es->txhead = ea->txnext;
+		if (es->txtail == ea)
+			es->txtail = prev;
+		break;
 	}
 
-	sp_srv_process_req(req);
+	ea->txpending = 0;
+	ea->txnext = 0;
+}
+
+static void
+sp_ethsrv2_tx_queue(Ethsrv2 *es, Ethaddr *ea)
+{
+	if (ea->txpending)
+		return;
+
+	ea->txpending = 1;
+	ea->txnext = 0;
+	if (es->txtail != 0)
+		es->txtail->txnext = ea;
+	else
+		es->txhead = ea;
+	es->txtail = ea;
+}
+
+static Ethtx *
+sp_ethsrv2_tx_entry(Ethaddr *ea, int k)
+{
+	return &ea->tx[(ea->txfirst + k) % ETHSRV2_TXWINDOW];
+}
+
+static void
+sp_ethsrv2_tx_release(Ethtx *t)
+{
+	sp_fcall_free(t->rc);
+	t->rc = 0;
+}
+
+// drop the released entries from the start of the window
+static void
+sp_ethsrv2_tx_trim(Ethaddr *ea)
+{
+	while (ea->ntx > 0 && ea->tx[ea->txfirst].rc == 0)
+	{
+		ea->txfirst = (ea->txfirst + 1) % ETHSRV2_TXWINDOW;
+		ea->ntx--;
+	}
+}
+
+static void
+sp_ethsrv2_tx_reset(Ethaddr *ea)
+{
+	int k;
+	for (k = 0; k < ea->ntx; k++)
+		sp_ethsrv2_tx_release(sp_ethsrv2_tx_entry(ea, k));
+
+	ea->txfirst = 0;
+	ea->ntx = 0;
+}
+
+// move the queued responses of the connection to the window
+static void
+sp_ethsrv2_tx_fill(Ethaddr *ea)
+{
+	Spconn *conn = ea->conn;
+
+	while (conn->oreqs != 0 && ea->ntx < ETHSRV2_TXWINDOW)
+	{
+		Spfcall *rc = 0;
+		sp_conn_sent_keep(conn, &rc);
+		if (rc == 0)
+			continue;
+
+		Ethtx *t = sp_ethsrv2_tx_entry(ea, ea->ntx);
+		t->rc = rc;
+		t->tag = rc->tag;
+		t->seq = ea->reliable ?ea->sndnxt++ :0;
+		t->off = 0;
+		t->stamp = 0;
+		t->tries = 0;
+		ea->ntx++;
+	}
+}
+
+// nothing to send now
+static int
+sp_ethsrv2_tx_idle(Ethaddr *ea)
+{
+	int k;
+	for (k = 0; k < ea->ntx; k++)
+	{
+		Ethtx *t = sp_ethsrv2_tx_entry(ea, k);
+		if (t->rc != 0 && t->off < t->rc->size)
+			return 0;
+	}
+
+	return ea->conn->oreqs == 0 || ea->ntx == ETHSRV2_TXWINDOW;
+}
+
+static void
+sp_ethsrv2_rel_unlink(Ethsrv2 *es, Ethaddr *ea)
+{
+	Ethaddr **pea;
+	for (pea = &es->rel; *pea != 0; pea = &(*pea)->relnext)
+	{
+		if (*pea == ea)
+		{
+			*pea = ea->relnext;
+			break;
+		}
+	}
+
+	ea->relnext = 0;
+}
+
+void
+sp_ethsrv2_remove_conn(Spsrv *srv, Spconn *conn, void *sap)
+{
+	Ethsrv2 *es = srv->srvaux;
+
+	Ethaddr **pea = &es->htable[sp_ethsrv2_hash(es, sap)];
+	while (*pea != 0)
+	{
+		Ethaddr *ea = *pea;
+		if (ea->conn == conn)
+		{
+			if (ea->txpending)
+				sp_ethsrv2_tx_unlink(es, ea);
+			if (ea->reliable)
+				sp_ethsrv2_rel_unlink(es, ea);
+			if (ea->credited)
+				es->ncredited--;
+			sp_ethsrv2_tx_reset(ea);
+			sp_ethframe_reset(conn, ea->rasm, ETHSRV2_NRASM);
+			*pea = ea->next;
+			free(ea);
+			es->nr_conns--;
+			break;
+		}
+		pea = &ea->next;
+	}
+}
+
+static long long
+sp_ethsrv2_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+//
+// Recompute the credit every ETHSRV2_CREDIT_TICK. The requests the socket
+// can hold are shared by the guests that were busy during the last tick.
+// If more requests than that are in flight the server is behind, and the
+// share shrinks in proportion.
+//
+
+static void
+sp_ethsrv2_credit_update(Ethsrv2 *es)
+{
+	long long now = sp_ethsrv2_now();
+	if (now - es->cstamp < ETHSRV2_CREDIT_TICK)
+		return;
+	es->cstamp = now;
+
+	int busy = 0;
+	int inflight = 0;
+	int i;
+	for (i = 0; i < es->hsize; i++)
+	{
+		Ethaddr *ea;
+		for (ea = es->htable[i]; ea != 0; ea = ea->next)
+		{
+			if (ea->nrecv > 0 || ea->conn->nreqs > 0)
+				busy++;
+			inflight += ea->conn->nreqs;
+			ea->nrecv = 0;
+		}
+	}
+
+	int share = es->credits / (busy > 0 ?busy :1);
+	if (inflight > es->credits)
+		share = (long long)share * es->credits / inflight;
+	if (share > ETHSRV2_MAXCREDIT)
+		share = ETHSRV2_MAXCREDIT;
+	if (share < 1)
+		share = 1;
+
+	es->share = share;
+}
+
+static u32
+sp_ethsrv2_credit(Ethsrv2 *es, Ethaddr *ea)
+{
+	// a lower credit is enforced once the guest is within it
+	ea->credit = es->share;
+	if (ea->credit >= ea->climit || ea->conn->nreqs <= ea->credit)
+		ea->climit = ea->credit;
+
+	return ea->credit;
+}
+
+// Tflush is always accepted, the guest may need it to free credits
+static int
+sp_ethsrv2_overcredit(Ethaddr *ea, u8 type)
+{
+	return ea->credited && type != Tflush && ea->conn->nreqs >= ea->climit;
+}
+
+static void sp_ethsrv2_flush(Spsrv *srv);
+static void sp_ethsrv2_retransmit(Sptimer *timer, void *aux);
+
+//
+// The guest starts a new session, forget the state of the old one.
+//
+
+static void
+sp_ethsrv2_syn(Spsrv *srv, Ethaddr *ea, u32 seq)
+{
+	Ethsrv2 *es = srv->srvaux;
+
+	// a fragment or a resend of the same message, the guest sends
+	// nothing else until it gets the response
+	if (ea->reliable && ea->synseq == seq && ea->rcvbase - seq <= 1)
+		return;
+
+	if (!ea->reliable)
+	{
+		ea->relnext = es->rel;
+		es->rel = ea;
+	}
+
+	if (es->rtimer == 0)
+		es->rtimer = sp_timer_add(ETHSRV2_RTO_TICK, sp_ethsrv2_retransmit, srv);
+
+	sp_ethsrv2_tx_reset(ea);
+	ea->reliable = 1;
+	ea->synseq = seq;
+	ea->sndnxt = 1;
+	ea->rcvbase = seq;
+	ea->rcvmask = 0;
+}
+
+// release the responses the guest has got
+static void
+sp_ethsrv2_acked(Ethsrv2 *es, Ethaddr *ea, u32 ack)
+{
+	int k;
+	for (k = 0; k < ea->ntx; k++)
+	{
+		Ethtx *t = sp_ethsrv2_tx_entry(ea, k);
+		if (t->rc != 0 && t->off == t->rc->size && (int)(ack - t->seq) >= 0)
+			sp_ethsrv2_tx_release(t);
+	}
+
+	sp_ethsrv2_tx_trim(ea);
+	if (ea->conn->oreqs != 0 && ea->ntx < ETHSRV2_TXWINDOW)
+		sp_ethsrv2_tx_queue(es, ea);
+}
+
+// record the request seq, returns 1 if it was already received
+static int
+sp_ethsrv2_seen(Ethaddr *ea, u32 seq)
+{
+	int d = seq - ea->rcvbase;
+	if (d < 0)
+		return 1;
+
+	if (d >= 64)
+	{
+		// too far ahead, give up on the oldest missing requests
+		int n = d - 63;
+		ea->rcvmask = (n < 64) ?ea->rcvmask >> n :0;
+		ea->rcvbase += n;
+		d = 63;
+	}
+
+	if (ea->rcvmask & (1ULL << d))
+		return 1;
+
+	ea->rcvmask |= 1ULL << d;
+	while (ea->rcvmask & 1)
+	{
+		ea->rcvmask >>= 1;
+		ea->rcvbase++;
+	}
+
+	return 0;
+}
+
+//
+// A request with this tag arrived again. If resend is set the guest lost
+// the response, send it again instead of executing the request twice.
+// Otherwise the tag was reused, so the guest has the old response.
+//
+
+static void
+sp_ethsrv2_retag(Ethsrv2 *es, Ethaddr *ea, u16 tag, int resend)
+{
+	int k;
+	for (k = 0; k < ea->ntx; k++)
+	{
+		Ethtx *t = sp_ethsrv2_tx_entry(ea, k);
+		if (t->rc == 0 || t->tag != tag || t->off < t->rc->size)
+			continue;
+
+		if (resend)
+		{
+			t->off = 0;
+			sp_ethsrv2_tx_queue(es, ea);
+		}
+		else
+			sp_ethsrv2_tx_release(t);
+	}
+
+	sp_ethsrv2_tx_trim(ea);
+}
+
+static void
+sp_ethsrv2_retransmit(Sptimer *timer, void *aux)
+{
+	Spsrv *srv = aux;
+	Ethsrv2 *es = srv->srvaux;
+
+	long long now = sp_ethsrv2_now();
+	Ethaddr *ea;
+	for (ea = es->rel; ea != 0; ea = ea->relnext)
+	{
+		int k;
+		for (k = 0; k < ea->ntx; k++)
+		{
+			Ethtx *t = sp_ethsrv2_tx_entry(ea, k);
+			if (t->rc == 0 || t->off < t->rc->size)
+				continue;
+
+			if (now - t->stamp < ((long long)ETHSRV2_RTO << (t->tries - 1)))
+				continue;
+
+			if (t->tries >= ETHSRV2_MAXTRIES)
+			{
+				if (srv->debuglevel > 0)
+					fprintf(stderr, "sp_ethsrv2_retransmit: conn %p tag %d given up\n",
+									ea->conn, t->tag);
+				sp_ethsrv2_tx_release(t);
+				continue;
+			}
+
+			t->off = 0;
+			sp_ethsrv2_tx_queue(es, ea);
+		}
+
+		sp_ethsrv2_tx_trim(ea);
+	}
+
+	if (es->txhead != 0 && spfd_can_write(es->txspfd))
+		sp_ethsrv2_flush(srv);
+}
+
+static void
+sp_ethsrv2_request(Spsrv *srv, Ethaddr *ea, Spfcall *fc)
+{
+	Spconn *conn = ea->conn;
+
+	ea->nrecv++;
+	Spreq *req = sp_req_alloc(conn, fc);
+	if (req == 0)
+	{
+		sp_conn_free_incall(conn, fc);
+		return;
+	}
+
+	if (sp_deserialize(fc, fc->pkt, conn->dotu) == 0)
+   	{
+		fprintf(stderr, "error while deserializing\n");
+		sp_req_free(req);
+		sp_conn_free_incall(conn, fc);
+		return;
+	}
+
+	if (srv->debuglevel > 0)
+	{
+		fprintf(stderr, "<<< (%p) ", conn);
+		sp_printfcall(stderr, fc, conn->dotu);
+		fprintf(stderr, "\n");
+	}
+
+	sp_srv_process_req(req);
+}
+
+//
+// Handle the requests of a packed frame one by one, each goes through the
+// same checks as a request in a frame of its own.
+//
+
+static void
+sp_ethsrv2_unpack(Spsrv *srv, Ethaddr *ea, Ethframe *f)
+{
+	Ethsrv2 *es = srv->srvaux;
+	Spconn *conn = ea->conn;
+
+	u8 *p = f->data;
+	u8 *ep = f->data + f->count;
+	u32 seq = f->seq;
+	while (ep - p >= 7)
+	{
+		u32 size = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+		if (size < 7 || size > ep - p)
+		{
+			fprintf(stderr, "sp_ethsrv2_notify: bad packed message of %d bytes\n", size);
+			return;
+		}
+
+		if (sp_ethsrv2_overcredit(ea, p[4]))
+		{
+			if (srv->debuglevel > 0)
+				fprintf(stderr, "sp_ethsrv2_notify: conn %p over credit, request dropped\n", conn);
+		}
+		else
+		{
+			int dup = 0;
+			if (f->flags & ETHFRAME_REL)
+			{
+				dup = sp_ethsrv2_seen(ea, seq);
+				sp_ethsrv2_retag(es, ea, p[5] | (p[6] << 8), dup);
+			}
+
+			if (!dup)
+			{
+				Spfcall *fc = sp_conn_new_incall(conn);
+				if (fc == 0)
+					return;
+
+				memcpy(fc->pkt, p, size);
+				sp_ethsrv2_request(srv, ea, fc);
+			}
+		}
+
+		p += size;
+		seq++;
+	}
+}
+
+//
+// Handle a frame from a guest. If rxfc is set, the frame was received
+// directly into the pooled buffer *rxfc; the connection keeps it and
+// *rxfc is replaced by a free buffer of the connection, or NULL. The
+// csum field is at csump if set, at the end of the frame otherwise.
+//
+
+static void
+sp_ethsrv2_input(Spsrv *srv, uint8_t *buf, int len, uint8_t *csump,
+		struct sockaddr_ll *sap, Spfcall **rxfc)
+{
+	Ethsrv2 *es = srv->srvaux;
+
+	Spfcall *fc;
+	Ethframe f;
+	struct sockaddr_ll saddr = *sap;
+
+	int frag = sp_ethframe_parse(buf, len -4, &f);	// -4: csum field
+	if (frag < 0)
+	{
+		fprintf(stderr, "sp_ethsrv2_notify: bad frame of %d bytes\n", len);
+		return;
+	}
+
+	if (f.flags & ETHFRAME_CSUM)
+	{
+		u8 *p = csump ?csump :buf + len -4;
+		u32 csum = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+		if (sp_crc32c(0, buf, len -4) != csum)
+		{
+			if (srv->debuglevel > 0)
+				fprintf(stderr, "sp_ethsrv2_notify: bad csum, frame dropped\n");
+			return;
+		}
+	}
+
+	Ethaddr *ea = sp_ethsrv2_find_addr(es, &saddr);
+	if (ea == 0)
+	{
+		//
+		// An unknown client sends the first message; create a new connection.
+		//
+
+		Ethif *ifp = sp_ethsrv2_find_if(es, saddr.sll_ifindex);
+		if (ifp == 0)
+			return;		// not an interface we serve
+
+		Spconn *conn = sp_ethconn2_create(srv, &saddr);
+		if (conn == 0)
+		{
+			if (srv->debuglevel > 0)
+				fprintf(stderr, "sp_ethsrv2_notify: connection refused\n");
+			return;
+		}
+
+		ea = sp_ethsrv2_add_conn(es, &saddr, ifp, conn);
+		if (ea == 0)
+		{
+			sp_conn_shutdown(conn);
+			return;
+		}
+
+		uint8_t *mac = saddr.sll_addr;
+		fprintf(stderr, "A new connection to %02x:%02x:%02x:%02x:%02x:%02x added\n",
+				mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+	}
+
+	Spconn *conn = ea->conn;
+
+	// checksum the responses once the guest does
+	if (f.flags & ETHFRAME_CSUM)
+		ea->csum = 1;
+
+	if (f.flags & ETHFRAME_PACK)
+		ea->pack = 1;
+
+	if ((f.flags & ETHFRAME_CRED) && !ea->credited)
+	{
+		ea->credited = 1;
+		ea->credit = es->share;
+		ea->climit = es->share;
+		es->ncredited++;
+	}
+
+	//
+	// Any frame, even an ACK or a dropped one, shows the guest is alive.
+	// The connections of the guests are closed when their interface goes
+	// away; if srv->conntimeout is set, the server reaper also closes the
+	// ones that have been quiet for that long.
+	//
+
+	conn->atime = time(0);
+
+	if (f.flags & ETHFRAME_REL)
+	{
+		if ((f.flags & ETHFRAME_SYN) || !ea->reliable)
+			sp_ethsrv2_syn(srv, ea, f.seq);
+
+		sp_ethsrv2_acked(es, ea, f.ack);
+		if (f.flags & ETHFRAME_ACK)
+			return;
+	}
+
+	//
+	// The socket is shared by all guests, so a guest that doesn't keep up
+	// with its responses, or is out of memory, can't be paused; drop its
+	// requests instead.
+	//
+
+	if (sp_conn_throttle(conn))
+	{
+		if (srv->debuglevel > 0)
+			fprintf(stderr, "sp_ethsrv2_notify: conn %p throttled, frame dropped\n", conn);
+		return;
+	}
+
+	if (f.total > conn->msize)
+	{
+		fprintf(stderr, "sp_ethsrv2_notify: packet too big %d\n", f.total);
+		return;
+	}
+
+	//
+	// Requests over the credit are dropped before the reliable delivery
+	// sees them, so the guest resends them later.
+	//
+
+	if (f.flags & ETHFRAME_PACK)
+	{
+		sp_ethsrv2_unpack(srv, ea, &f);
+		return;
+	}
+
+	if (frag)
+	{
+		fc = sp_ethframe_reassemble(conn, ea->rasm, ETHSRV2_NRASM, &f);
+		if (fc == 0)
+			return;		// more fragments to come
+
+		if (sp_ethsrv2_overcredit(ea, fc->pkt[4]))
+		{
+			if (srv->debuglevel > 0)
+				fprintf(stderr, "sp_ethsrv2_notify: conn %p over credit, request dropped\n", conn);
+			sp_conn_free_incall(conn, fc);
+			return;
+		}
+
+		if (f.flags & ETHFRAME_REL)
+		{
+			int dup = sp_ethsrv2_seen(ea, f.seq);
+			sp_ethsrv2_retag(es, ea, f.tag, dup);
+			if (dup)
+			{
+				sp_conn_free_incall(conn, fc);
+				return;
+			}
+		}
+	}
+	else if (sp_ethsrv2_overcredit(ea, buf[4]))
+	{
+		if (srv->debuglevel > 0)
+			fprintf(stderr, "sp_ethsrv2_notify: conn %p over credit, request dropped\n", conn);
+		return;
+	}
+	else if (rxfc != 0 && conn->msize >= srv->msize)
+	{
+		fc = *rxfc;
+		*rxfc = sp_conn_swap_incall(conn, fc, srv->msize);
+	}
+	else
+	{
+		//
+		// The ring memory goes back to the kernel, the request keeps
+		// pointers into the packet. The buffers of a guest with a
+		// smaller msize are too small for the receive pool, its
+		// requests are copied too and the pooled buffer stays.
+		//
+
+		fc = sp_conn_new_incall(conn);
+		if (fc == 0)
+			return;
+		memcpy(fc->pkt, buf, f.total);
+	}
+
+	sp_ethsrv2_request(srv, ea, fc);
+}
+
+//
+// Pack the responses from the window entry k on in one frame, as many as
+// fit. Reliable responses are packed only while their seq numbers follow
+// each other. Returns the number of responses packed, 0 if fewer than two
+// would fit.
+//
+
+static int
+sp_ethsrv2_pack(Ethsrv2 *es, Ethaddr *ea, int k, struct msghdr *mh,
+		uint8_t *hdr, uint8_t *csum, Ethtx **txs)
+{
+	Ethframe f;
+	f.tag = 0;
+	f.flags = ETHFRAME_PACK | (ea->reliable ?ETHFRAME_REL :0) |
+		(ea->csum ?ETHFRAME_CSUM :0) | (ea->credited ?ETHFRAME_CRED :0);
+	f.offset = 0;
+	f.total = 0;
+	f.seq = 0;
+	f.ack = ea->rcvbase - 1;
+	f.credit = 0;
+	int hdrsz = sp_ethframe_put(hdr, &f);
+
+	u32 room = ea->mtu - hdrsz - (ea->csum ?4 :0);
+	struct iovec *iov = mh->msg_iov;
+	int n = 0;
+	int v = 1;
+	for (; k < ea->ntx && n < ETHSRV2_MAXPACK; k++)
+	{
+		Ethtx *t = sp_ethsrv2_tx_entry(ea, k);
+		if (t->rc == 0)
+			continue;
+
+		if (t->off != 0 || t->rc->size > room - f.total)
+			break;
+
+		if (n > 0 && ea->reliable && t->seq != txs[n-1]->seq + 1)
+			break;
+
+		v += sp_fcall_iov(t->rc, 0, t->rc->size, &iov[v]);
+		txs[n++] = t;
+		f.total += t->rc->size;
+	}
+
+	if (n < 2)
+		return 0;
+
+	f.tag = n;
+	f.seq = txs[0]->seq;
+	f.credit = ea->credited ?sp_ethsrv2_credit(es, ea) :0;
+	sp_ethframe_put(hdr, &f);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = hdrsz;
+	mh->msg_iovlen = v;
+
+	if (ea->csum)
+	{
+		u32 c = sp_crc32c(0, hdr, hdrsz);
+		int i;
+		for (i = 1; i < v; i++)
+			c = sp_crc32c(c, iov[i].iov_base, iov[i].iov_len);
+		csum[0] = c;
+		csum[1] = c >> 8;
+		csum[2] = c >> 16;
+		csum[3] = c >> 24;
+		iov[v].iov_base = csum;
+		iov[v].iov_len = 4;
+		mh->msg_iovlen = v + 1;
+	}
+
+	return n;
+}
+
+//
+// Send the queued responses of all guests, up to ETHSRV2_TXBATCH frames
+// per sendmmsg(). If the socket is full the rest waits for POLLOUT.
+//
+
+static void
+sp_ethsrv2_flush(Spsrv *srv)
+{
+	Ethsrv2 *es = srv->srvaux;
+
+	struct mmsghdr msgs[ETHSRV2_TXBATCH];
+	struct iovec iov[ETHSRV2_TXBATCH][2*ETHSRV2_MAXPACK + 2];	// see sp_fcall_iov
+	uint8_t hdrs[ETHSRV2_TXBATCH][ETHFRAME_MAXHDRSZ];
+	uint8_t csums[ETHSRV2_TXBATCH][4];
+	Ethaddr *feas[ETHSRV2_TXBATCH];
+	Ethtx *ftxs[ETHSRV2_TXBATCH][ETHSRV2_MAXPACK];
+	int nftxs[ETHSRV2_TXBATCH];
+	u32 ends[ETHSRV2_TXBATCH];
+
+	if (es->ncredited > 0)
+		sp_ethsrv2_credit_update(es);
+
+	while (es->txhead != 0)
+	{
+		//
+		// Responses that don't fit in a frame, and all responses to
+		// guests that use reliable delivery, checksums or credits, are
+		// sent with the fragment header. Guests that pack their
+		// requests get small responses packed too.
+		//
+
+		int n = 0;
+		Ethaddr *ea;
+		for (ea = es->txhead; ea != 0 && n < ETHSRV2_TXBATCH; ea = ea->txnext)
+		{
+			sp_ethsrv2_tx_fill(ea);
+
+			int k;
+			for (k = 0; k < ea->ntx && n < ETHSRV2_TXBATCH; k++)
+			{
+				Ethtx *t = sp_ethsrv2_tx_entry(ea, k);
+				if (t->rc == 0)
+					continue;
+
+				if (ea->pack)
+				{
+					memset(&msgs[n].msg_hdr, 0, sizeof(msgs[n].msg_hdr));
+					msgs[n].msg_hdr.msg_iov = iov[n];
+					int m = sp_ethsrv2_pack(es, ea, k, &msgs[n].msg_hdr,
+							hdrs[n], csums[n], ftxs[n]);
+					if (m > 0)
+					{
+						msgs[n].msg_hdr.msg_name = &ea->saddr;
+						msgs[n].msg_hdr.msg_namelen = sizeof(ea->saddr);
+						feas[n] = ea;
+						nftxs[n] = m;
+						n++;
+
+						// continue after the last one packed
+						while (sp_ethsrv2_tx_entry(ea, k) != ftxs[n-1][m-1])
+							k++;
+						continue;
+					}
+				}
+
+				Spfcall *rc = t->rc;
+				u32 off = t->off;
+				while (off < rc->size && n < ETHSRV2_TXBATCH)
+				{
+					memset(&msgs[n].msg_hdr, 0, sizeof(msgs[n].msg_hdr));
+					if (!ea->reliable && !ea->csum && !ea->credited &&
+					    rc->size <= ea->mtu)
+					{
+						msgs[n].msg_hdr.msg_iovlen = sp_fcall_iov(rc, 0, rc->size, iov[n]);
+						off = rc->size;
+					}
+					else
+					{
+						Ethframe f;
+						f.tag = t->tag;
+						f.flags = (ea->reliable ?ETHFRAME_REL :0) |
+							(ea->csum ?ETHFRAME_CSUM :0) |
+							(ea->credited ?ETHFRAME_CRED :0);
+						f.offset = off;
+						f.total = rc->size;
+						f.seq = t->seq;
+						f.ack = ea->rcvbase - 1;
+						f.credit = ea->credited ?sp_ethsrv2_credit(es, ea) :0;
+						int hdrsz = sp_ethframe_put(hdrs[n], &f);
+
+						u32 count = ea->mtu - hdrsz - (ea->csum ?4 :0);
+						if (count > rc->size - off)
+							count = rc->size - off;
+						iov[n][0].iov_base = hdrs[n];
+						iov[n][0].iov_len = hdrsz;
+						int v = 1 + sp_fcall_iov(rc, off, count, &iov[n][1]);
+						msgs[n].msg_hdr.msg_iovlen = v;
+
+						if (ea->csum)
+						{
+							u32 csum = 0;
+							int j;
+							for (j = 0; j < v; j++)
+								csum = sp_crc32c(csum, iov[n][j].iov_base, iov[n][j].iov_len);
+							csums[n][0] = csum;
+							csums[n][1] = csum >> 8;
+							csums[n][2] = csum >> 16;
+							csums[n][3] = csum >> 24;
+							iov[n][v].iov_base = csums[n];
+							iov[n][v].iov_len = 4;
+							msgs[n].msg_hdr.msg_iovlen = v + 1;
+						}
+						off += count;
+					}
+
+					msgs[n].msg_hdr.msg_name = &ea->saddr;
+					msgs[n].msg_hdr.msg_namelen = sizeof(ea->saddr);
+					msgs[n].msg_hdr.msg_iov = iov[n];
+					feas[n] = ea;
+					ftxs[n][0] = t;
+					nftxs[n] = 1;
+					ends[n] = off;
+					n++;
+				}
+			}
+		}
+
+		int i;
+		int sent = 0;
+		if (n > 0)
+		{
+			if (es->xdp != 0)
+				sent = sp_ethxdp_send(es->xdp, msgs, n);
+			else
+				sent = sendmmsg(es->fd, msgs, n, MSG_DONTWAIT);
+			if (sent < 0)
+			{
+				if (errno == EAGAIN || errno == ENOBUFS || errno == EINTR)
+				{
+					spfd_write(es->txspfd, 0, 0);	// wait for POLLOUT
+					return;
+				}
+
+				// the first frame can't be sent at all, skip the response
+				if (srv->debuglevel > 0)
+					fprintf(stderr, "sp_ethsrv2_flush: frame dropped: %d\n", errno);
+				ends[0] = ftxs[0][0]->rc->size;
+				sent = 1;
+			}
+		}
+
+		long long now = sp_ethsrv2_now();
+		for (i = 0; i < sent; i++)
+		{
+			int j;
+			for (j = 0; j < nftxs[i]; j++)
+			{
+				Ethtx *t = ftxs[i][j];
+				t->off = (nftxs[i] > 1) ?t->rc->size :ends[i];
+				if (t->off < t->rc->size)
+					continue;
+
+				ea = feas[i];
+				if (srv->debuglevel > 0 && t->tries == 0)
+				{
+					fprintf(stderr, ">>> (%p) ", ea->conn);
+					sp_printfcall(stderr, t->rc, ea->conn->dotu);
+					fprintf(stderr, "\n");
+				}
+
+				t->stamp = now;
+				t->tries++;
+				if (!ea->reliable)
+					sp_ethsrv2_tx_release(t);
+			}
+		}
+
+		for (i = 0; i < sent; i++)
+			sp_ethsrv2_tx_trim(feas[i]);
+
+		while (es->txhead != 0 && sp_ethsrv2_tx_idle(es->txhead))
+		{
+			ea = es->txhead;
+			es->txhead = ea->txnext;
+			if (es->txhead == 0)
+				es->txtail = 0;
+			ea->txpending = 0;
+			ea->txnext = 0;
+		}
+
+		if (sent < n)
+		{
+			spfd_write(es->txspfd, 0, 0);
+			return;
+		}
+	}
+}
+
+//
+// Called by ethconn2 when a response is queued. Responses produced while
+// the incoming frames are processed go out in one batch at the end of
+// sp_ethsrv2_notify(), others are sent right away.
+//
+
+void
+sp_ethsrv2_dataout(Spsrv *srv, Spconn *conn, void *sap)
+{
+	Ethsrv2 *es = srv->srvaux;
+
+	Ethaddr *ea = sp_ethsrv2_find_addr(es, sap);
+	if (ea == 0 || ea->conn != conn)
+		return;
+
+	sp_ethsrv2_tx_queue(es, ea);
+	if (!es->innotify && spfd_can_write(es->txspfd))
+		sp_ethsrv2_flush(srv);
+}
+
+static void
+sp_ethsrv2_read_ring(Spsrv *srv)
+{
+	Ethsrv2 *es = srv->srvaux;
+
+	//
+	// Consume all blocks retired by the kernel, the frames are copied to
+	// the incall buffers directly from the shared memory.
+	//
+
+	for (;;)
+	{
+		struct tpacket_block_desc *bd = (struct tpacket_block_desc *)
+				(es->ring + es->ring_cur * es->ring_bsize);
+		if ((bd->hdr.bh1.block_status & TP_STATUS_USER) == 0)
+			break;
+		__sync_synchronize();
+
+		struct tpacket3_hdr *h = (struct tpacket3_hdr *)
+				((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+		int i;
+		for (i = 0; i < bd->hdr.bh1.num_pkts; i++)
+		{
+			struct sockaddr_ll *sap = (struct sockaddr_ll *)
+					((uint8_t *)h + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+			sp_ethsrv2_input(srv, (uint8_t *)h + h->tp_mac, h->tp_snaplen, 0, sap, 0);
+			h = (struct tpacket3_hdr *)((uint8_t *)h + h->tp_next_offset);
+		}
+
+		__sync_synchronize();
+		bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		es->ring_cur = (es->ring_cur + 1) % es->ring_bnum;
+	}
+}
+
+//
+// Receive up to ETHSRV2_RXBATCH frames with a single recvmmsg(), straight
+// into pooled incall buffers that are passed on to the connections.
+//
+
+static void
+sp_ethsrv2_read_batch(Spsrv *srv)
+{
+	Ethsrv2 *es = srv->srvaux;
+
+	struct mmsghdr msgs[ETHSRV2_RXBATCH];
+	struct iovec iov[ETHSRV2_RXBATCH][2];
+	struct sockaddr_ll saddrs[ETHSRV2_RXBATCH];
+	uint8_t csum[ETHSRV2_RXBATCH][4];
+
+	int i;
+	for (i = 0; i < ETHSRV2_RXBATCH; i++)
+	{
+		Spfcall *fc = es->rxpool[i];
+		if (fc == 0)
+		{
+			fc = sp_malloc(sizeof(*fc) + srv->msize);
+			if (fc == 0)
+				break;
+			fc->pkt = (uint8_t *)fc + sizeof(*fc);
+			es->rxpool[i] = fc;
+		}
+
+		// the csum field lands in csum[] only for maximum size frames
+		iov[i][0].iov_base = fc->pkt;
+		iov[i][0].iov_len = srv->msize;
+		iov[i][1].iov_base = csum[i];
+		iov[i][1].iov_len = sizeof(csum[i]);
+
+		memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+		msgs[i].msg_hdr.msg_name = &saddrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(saddrs[i]);
+		msgs[i].msg_hdr.msg_iov = iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	if (i == 0)
+		return;
+
+	int n = recvmmsg(es->fd, msgs, i, MSG_DONTWAIT, 0);
+	if (n < 0)
+		return;
+
+	for (i = 0; i < n; i++)
+	{
+		if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+			continue;
+
+		// the csum field of a frame over msize is split between the
+		// buffer and csum[], put it together
+		int len = msgs[i].msg_len;
+		uint8_t *pkt = es->rxpool[i]->pkt;
+		uint8_t tail[4];
+		uint8_t *csump = 0;
+		if (len > srv->msize)
+		{
+			int k;
+			for (k = 0; k < 4; k++)
+			{
+				int pos = len - 4 + k;
+				tail[k] = pos < srv->msize ?pkt[pos] :csum[i][pos - srv->msize];
+			}
+			csump = tail;
+		}
+
+		sp_ethsrv2_input(srv, pkt, len, csump, &saddrs[i], &es->rxpool[i]);
+	}
+}
+
+static void
+sp_ethsrv2_notify(Spfd *spfd, void *aux)
+{
+	Spsrv *srv = aux;
+	Ethsrv2 *es = srv->srvaux;
+
+	if (spfd_can_read(spfd))
+	{
+		spfd_read(spfd, 0, 0);	// reset POLLIN event
+
+		es->innotify = 1;
+		if (es->ring != 0)
+			sp_ethsrv2_read_ring(srv);
+		else
+			sp_ethsrv2_read_batch(srv);
+		es->innotify = 0;
+	}
+
+	if (es->txhead != 0 && spfd_can_write(es->txspfd))
+		sp_ethsrv2_flush(srv);
+}
+
+//
+// Frames redirected to the AF_XDP socket are read from the UMEM, the
+// guest address is taken from the Ethernet header.
+//
+
+static void
+sp_ethsrv2_notify_xdp(Spfd *spfd, void *aux)
+{
+	Spsrv *srv = aux;
+	Ethsrv2 *es = srv->srvaux;
+
+	if (spfd_can_read(spfd))
+	{
+		spfd_read(spfd, 0, 0);	// reset POLLIN event
+
+		es->innotify = 1;
+		u8 *bufs[ETHSRV2_RXBATCH];
+		int lens[ETHSRV2_RXBATCH];
+		int n;
+		while ((n = sp_ethxdp_recv(es->xdp, bufs, lens, ETHSRV2_RXBATCH)) > 0)
+		{
+			int i;
+			for (i = 0; i < n; i++)
+			{
+				if (lens[i] < ETH_HLEN)
+					continue;
+
+				// the XDP program doesn't check the OUI
+				struct ether_header *eh = (struct ether_header *)bufs[i];
+				u8 *mac = eh->ether_shost;
+				if (((mac[0] << 16) | (mac[1] << 8) | mac[2]) != ETHSRV2_OUI)
+					continue;
+
+				struct sockaddr_ll saddr = {
+					.sll_family = AF_PACKET,
+					.sll_protocol = htons(EXP_9P_ETH),
+					.sll_ifindex = es->ifindex,
+					.sll_halen = ETH_ALEN,
+				};
+				memmove(saddr.sll_addr, eh->ether_shost, ETH_ALEN);
+				sp_ethsrv2_input(srv, bufs[i] + ETH_HLEN, lens[i] - ETH_HLEN,
+						0, &saddr, 0);
+			}
+			sp_ethxdp_release(es->xdp);
+		}
+		es->innotify = 0;
+	}
+
+	if (es->txhead != 0 && spfd_can_write(spfd))
+		sp_ethsrv2_flush(srv);
 }
 
 //EOF
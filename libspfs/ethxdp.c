@@ -0,0 +1,463 @@
+//
+// AF_XDP socket for the Ethernet transport
+//
+// An XDP program attached to the interface redirects the frames with our
+// EtherType to the socket bound to one of its queues, everything else
+// goes up the kernel stack as usual. The frames are received into and
+// sent from the UMEM, a memory area shared with the kernel, split in
+// ETHXDP_FSIZE frames: the first half is handed to the kernel through
+// the fill ring for the received frames, the other half is used for the
+// frames to send.
+//
+// The program is loaded with the bpf() syscall directly, it is only a
+// few instructions and doesn't warrant a libbpf dependency.
+//
+
+#define _GNU_SOURCE	// struct mmsghdr
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <netpacket/packet.h>
+#include <net/ethernet.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include "spfs.h"
+#include "spfsimpl.h"
+
+#define ETHXDP_FSIZE		4096
+#define ETHXDP_NFRAMES		4096	// half for rx, half for tx
+#define ETHXDP_NRING		(ETHXDP_NFRAMES / 2)
+#define ETHXDP_BUSYPOLL		20	// usec
+#define ETHXDP_BUDGET		64
+
+typedef struct Xdpring Xdpring;
+
+struct Xdpring {
+	u32 *producer;
+	u32 *consumer;
+	void *desc;
+	u32 cached;	// producer or consumer, the side we own
+	void *map;
+	size_t mapsz;
+};
+
+struct Ethxdp {
+	int fd;
+	int mapfd;
+	int progfd;
+	int linkfd;
+	u8 haddr[ETH_ALEN];
+	u16 proto;
+
+	u8 *umem;
+	Xdpring rx;
+	Xdpring tx;
+	Xdpring fill;
+	Xdpring comp;
+
+	u64 txfree[ETHXDP_NRING];	// tx frames not in the kernel
+	int ntxfree;
+	int nrxheld;			// rx frames returned by sp_ethxdp_recv
+};
+
+#define INSN(c, d, s, o, i) \
+	((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+static int
+sp_ethxdp_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int
+sp_ethxdp_load(Ethxdp *x)
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(int);
+	attr.value_size = sizeof(int);
+	attr.max_entries = 64;
+	x->mapfd = sp_ethxdp_bpf(BPF_MAP_CREATE, &attr);
+	if (x->mapfd < 0)
+		return -1;
+
+	//
+	// if (data + ETH_HLEN <= data_end && eth->h_proto == proto)
+	//	return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS);
+	// return XDP_PASS;
+	//
+
+	struct bpf_insn prog[] = {
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),
+		INSN(BPF_LDX | BPF_W | BPF_MEM, 2, 6, offsetof(struct xdp_md, data), 0),
+		INSN(BPF_LDX | BPF_W | BPF_MEM, 3, 6, offsetof(struct xdp_md, data_end), 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+		INSN(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, ETH_HLEN),
+		INSN(BPF_JMP | BPF_JGT | BPF_X, 4, 3, 8, 0),
+		INSN(BPF_LDX | BPF_H | BPF_MEM, 4, 2, offsetof(struct ether_header, ether_type), 0),
+		INSN(BPF_JMP | BPF_JNE | BPF_K, 4, 0, 6, htons(x->proto)),
+		INSN(BPF_LDX | BPF_W | BPF_MEM, 2, 6, offsetof(struct xdp_md, rx_queue_index), 0),
+		INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, x->mapfd),
+		INSN(0, 0, 0, 0, 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),
+		INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),
+		INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (unsigned long)prog;
+	attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+	attr.license = (unsigned long)"GPL";
+	x->progfd = sp_ethxdp_bpf(BPF_PROG_LOAD, &attr);
+	if (x->progfd < 0)
+		return -1;
+
+	return 0;
+}
+
+static int
+sp_ethxdp_map_ring(Ethxdp *x, Xdpring *r, struct xdp_ring_offset *off,
+		int n, size_t dsize, off_t pgoff)
+{
+	r->mapsz = off->desc + n * dsize;
+	r->map = mmap(0, r->mapsz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, x->fd, pgoff);
+	if (r->map == MAP_FAILED)
+	{
+		r->map = 0;
+		return -1;
+	}
+
+	r->producer = (u32 *)((u8 *)r->map + off->producer);
+	r->consumer = (u32 *)((u8 *)r->map + off->consumer);
+	r->desc = (u8 *)r->map + off->desc;
+	return 0;
+}
+
+static int
+sp_ethxdp_socket(Ethxdp *x, int ifindex, int queue, int flags)
+{
+	x->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (x->fd < 0)
+		return -1;
+
+	x->umem = mmap(0, ETHXDP_NFRAMES * ETHXDP_FSIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (x->umem == MAP_FAILED)
+	{
+		x->umem = 0;
+		return -1;
+	}
+
+	struct xdp_umem_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (unsigned long)x->umem;
+	reg.len = ETHXDP_NFRAMES * ETHXDP_FSIZE;
+	reg.chunk_size = ETHXDP_FSIZE;
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0)
+		return -1;
+
+	int n = ETHXDP_NRING;
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &n, sizeof(n)) < 0 ||
+	    setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &n, sizeof(n)) < 0 ||
+	    setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &n, sizeof(n)) < 0 ||
+	    setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &n, sizeof(n)) < 0)
+		return -1;
+
+	struct xdp_mmap_offsets off;
+	socklen_t optlen = sizeof(off);
+	if (getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+		return -1;
+
+	if (sp_ethxdp_map_ring(x, &x->rx, &off.rx, n,
+			sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0 ||
+	    sp_ethxdp_map_ring(x, &x->tx, &off.tx, n,
+			sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0 ||
+	    sp_ethxdp_map_ring(x, &x->fill, &off.fr, n,
+			sizeof(u64), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+	    sp_ethxdp_map_ring(x, &x->comp, &off.cr, n,
+			sizeof(u64), XDP_UMEM_PGOFF_COMPLETION_RING) < 0)
+		return -1;
+
+	// give the rx half of the UMEM to the kernel
+	u64 *fill = x->fill.desc;
+	int i;
+	for (i = 0; i < ETHXDP_NRING; i++)
+		fill[i] = (u64)i * ETHXDP_FSIZE;
+	__atomic_store_n(x->fill.producer, ETHXDP_NRING, __ATOMIC_RELEASE);
+	x->fill.cached = ETHXDP_NRING;
+
+	for (i = 0; i < ETHXDP_NRING; i++)
+		x->txfree[i] = (u64)(ETHXDP_NRING + i) * ETHXDP_FSIZE;
+	x->ntxfree = ETHXDP_NRING;
+
+	struct sockaddr_xdp sxdp;
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = queue;
+	sxdp.sxdp_flags = (flags & Xzerocopy) ?XDP_ZEROCOPY :XDP_COPY;
+	if (bind(x->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0)
+		return -1;
+
+	if (flags & Xbusypoll)
+	{
+		int on = 1;
+		int usec = ETHXDP_BUSYPOLL;
+		int budget = ETHXDP_BUDGET;
+		if (setsockopt(x->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0 ||
+		    setsockopt(x->fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) < 0 ||
+		    setsockopt(x->fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+//
+// Bind an AF_XDP socket to queue of the interface and steer the frames of
+// EtherType proto to it. haddr is the interface MAC, the source of the
+// frames sent. Returns NULL and sets the error on failure.
+//
+
+Ethxdp *
+sp_ethxdp_create(int ifindex, int queue, u8 *haddr, u16 proto, int flags)
+{
+	Ethxdp *x = calloc(1, sizeof(*x));
+	if (x == 0)
+	{
+		sp_werror(Enomem, ENOMEM);
+		return NULL;
+	}
+
+	x->fd = -1;
+	x->mapfd = -1;
+	x->progfd = -1;
+	x->linkfd = -1;
+	memmove(x->haddr, haddr, ETH_ALEN);
+	x->proto = proto;
+
+	if (sp_ethxdp_load(x) < 0)
+	{
+		sp_suerror("cannot load the XDP program", errno);
+		goto error;
+	}
+
+	if (sp_ethxdp_socket(x, ifindex, queue, flags) < 0)
+	{
+		sp_suerror("cannot set up the AF_XDP socket", errno);
+		goto error;
+	}
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = x->mapfd;
+	attr.key = (unsigned long)&queue;
+	attr.value = (unsigned long)&x->fd;
+	if (sp_ethxdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+	{
+		sp_suerror("cannot add the AF_XDP socket to the map", errno);
+		goto error;
+	}
+
+	// the link detaches the program when closed, even if we crash
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = x->progfd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = (flags & Xdrvmode) ?XDP_FLAGS_DRV_MODE :XDP_FLAGS_SKB_MODE;
+	x->linkfd = sp_ethxdp_bpf(BPF_LINK_CREATE, &attr);
+	if (x->linkfd < 0)
+	{
+		sp_suerror("cannot attach the XDP program", errno);
+		goto error;
+	}
+
+	return x;
+
+error:
+	sp_ethxdp_destroy(x);
+	return NULL;
+}
+
+void
+sp_ethxdp_destroy(Ethxdp *x)
+{
+	if (x->linkfd >= 0)
+		close(x->linkfd);
+
+	Xdpring *rings[] = { &x->rx, &x->tx, &x->fill, &x->comp };
+	int i;
+	for (i = 0; i < 4; i++)
+		if (rings[i]->map != 0)
+			munmap(rings[i]->map, rings[i]->mapsz);
+
+	if (x->fd >= 0)
+		close(x->fd);
+	if (x->umem != 0)
+		munmap(x->umem, ETHXDP_NFRAMES * ETHXDP_FSIZE);
+	if (x->progfd >= 0)
+		close(x->progfd);
+	if (x->mapfd >= 0)
+		close(x->mapfd);
+	free(x);
+}
+
+int
+sp_ethxdp_fd(Ethxdp *x)
+{
+	return x->fd;
+}
+
+// the largest frame, without the Ethernet header
+int
+sp_ethxdp_maxframe(Ethxdp *x)
+{
+	return ETHXDP_FSIZE - XDP_PACKET_HEADROOM - ETH_HLEN;
+}
+
+//
+// Return up to max received frames. The frames stay valid, and aren't
+// returned again, until sp_ethxdp_release() is called. bufs point to the
+// Ethernet header.
+//
+
+int
+sp_ethxdp_recv(Ethxdp *x, u8 **bufs, int *lens, int max)
+{
+	u32 prod = __atomic_load_n(x->rx.producer, __ATOMIC_ACQUIRE);
+	u32 cons = x->rx.cached + x->nrxheld;
+	struct xdp_desc *desc = x->rx.desc;
+
+	int n;
+	for (n = 0; n < max && cons != prod; n++, cons++)
+	{
+		struct xdp_desc *d = &desc[cons & (ETHXDP_NRING - 1)];
+		bufs[n] = x->umem + d->addr;
+		lens[n] = d->len;
+	}
+
+	x->nrxheld += n;
+	return n;
+}
+
+// hand the frames returned by sp_ethxdp_recv() back to the kernel
+void
+sp_ethxdp_release(Ethxdp *x)
+{
+	struct xdp_desc *desc = x->rx.desc;
+	u64 *fill = x->fill.desc;
+
+	int i;
+	for (i = 0; i < x->nrxheld; i++)
+	{
+		u32 k = x->rx.cached + i;
+		fill[(x->fill.cached + i) & (ETHXDP_NRING - 1)] =
+			desc[k & (ETHXDP_NRING - 1)].addr;
+	}
+
+	// the fill ring has room for all rx frames
+	x->fill.cached += x->nrxheld;
+	__atomic_store_n(x->fill.producer, x->fill.cached, __ATOMIC_RELEASE);
+
+	x->rx.cached += x->nrxheld;
+	__atomic_store_n(x->rx.consumer, x->rx.cached, __ATOMIC_RELEASE);
+	x->nrxheld = 0;
+}
+
+static void
+sp_ethxdp_complete(Ethxdp *x)
+{
+	u32 prod = __atomic_load_n(x->comp.producer, __ATOMIC_ACQUIRE);
+	u64 *comp = x->comp.desc;
+
+	while (x->comp.cached != prod)
+		x->txfree[x->ntxfree++] = comp[x->comp.cached++ & (ETHXDP_NRING - 1)];
+
+	__atomic_store_n(x->comp.consumer, x->comp.cached, __ATOMIC_RELEASE);
+}
+
+//
+// Like sendmmsg(), the frames are copied to the UMEM with the Ethernet
+// header for the sll_addr in msg_name. Returns the number of frames queued,
+// or -1 with EAGAIN if there was room for none.
+//
+
+int
+sp_ethxdp_send(Ethxdp *x, struct mmsghdr *msgs, int n)
+{
+	sp_ethxdp_complete(x);
+
+	struct xdp_desc *desc = x->tx.desc;
+	u32 cons = __atomic_load_n(x->tx.consumer, __ATOMIC_ACQUIRE);
+
+	int i;
+	for (i = 0; i < n; i++)
+	{
+		if (x->ntxfree == 0 || x->tx.cached - cons == ETHXDP_NRING)
+			break;
+
+		struct msghdr *m = &msgs[i].msg_hdr;
+		struct sockaddr_ll *sap = m->msg_name;
+		u64 addr = x->txfree[x->ntxfree - 1];
+		u8 *p = x->umem + addr;
+
+		struct ether_header *eh = (struct ether_header *)p;
+		memmove(eh->ether_dhost, sap->sll_addr, ETH_ALEN);
+		memmove(eh->ether_shost, x->haddr, ETH_ALEN);
+		eh->ether_type = htons(x->proto);
+
+		u32 len = ETH_HLEN;
+		int j;
+		for (j = 0; j < m->msg_iovlen; j++)
+		{
+			if (len + m->msg_iov[j].iov_len > ETHXDP_FSIZE)
+				break;
+			memmove(p + len, m->msg_iov[j].iov_base, m->msg_iov[j].iov_len);
+			len += m->msg_iov[j].iov_len;
+		}
+		msgs[i].msg_len = len - ETH_HLEN;
+
+		struct xdp_desc *d = &desc[x->tx.cached++ & (ETHXDP_NRING - 1)];
+		d->addr = addr;
+		d->len = len;
+		d->options = 0;
+		x->ntxfree--;
+	}
+
+	if (i > 0)
+	{
+		__atomic_store_n(x->tx.producer, x->tx.cached, __ATOMIC_RELEASE);
+
+		//
+		// In copy mode the frames are sent from the syscall. If it fails
+		// they stay in the ring and go out with the next one.
+		//
+
+		sendto(x->fd, 0, 0, MSG_DONTWAIT, 0, 0);
+		sp_ethxdp_complete(x);
+	}
+
+	if (i == 0 && n > 0)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return i;
+}
+
+//EOF
@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <assert.h>
 #include "spfs.h"
 #include "spfsimpl.h"
@@ -44,6 +45,8 @@ char *Eopen = "file alread exclusively opened";
 char *Eexist = "file or directory already exists";
 char *Enotempty = "directory not empty";
 char *Eunknownuser = "unknown user";
+char *Eduptag = "duplicate tag";
+char *Etoomanyconns = "too many connections";
 
 Spfcall *
 sp_version(Spreq *req, Spfcall *tc)
@@ -214,20 +217,20 @@ sp_flush(Spreq *req, Spfcall *tc)
 	srv = conn->srv;
 	oldtag = tc->oldtag;
 
-	for(creq = srv->workreqs; creq != NULL; creq = creq->next)
-		if (creq->conn==conn && creq->tag==oldtag) {
-			if (!creq->flushreq && srv->flush) {
-				ret = (*srv->flush)(creq);
-			}
-
-			if (!ret) {
-				req->flushreq = creq->flushreq;
-				creq->flushreq = req;
-			}
+	creq = sp_conn_find_workreq(conn, oldtag);
+	if (creq && creq != req) {
+		if (!creq->flushreq && srv->flush) {
+			ret = (*srv->flush)(creq);
+		}
 
-			goto done;
+		if (!ret) {
+			req->flushreq = creq->flushreq;
+			creq->flushreq = req;
 		}
 
+		goto done;
+	}
+
 	// if not found, return Rflush
 	ret = sp_create_rflush();
 
@@ -318,6 +321,7 @@ done:
 Spfcall *
 sp_open(Spreq *req, Spfcall *tc)
 {
+	int fd;
 	Spconn *conn;
 	Spfid *fid;
 	Spfcall *rc;
@@ -344,6 +348,13 @@ sp_open(Spreq *req, Spfcall *tc)
 
 	rc = (*conn->srv->open)(fid, tc->mode);
 	fid->omode = tc->mode;
+
+	/* the file was opened as the user, the client gets the same access */
+	if (rc && rc->type==Ropen && conn->flags&Cpassfd) {
+		fd = (*conn->srv->openfd)(fid);
+		if (fd >= 0)
+			req->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	}
 done:
 //	sp_fid_decref(fid);
 	return rc;
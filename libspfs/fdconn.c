@@ -20,32 +20,43 @@
  * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
  * DEALINGS IN THE SOFTWARE.
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <sys/socket.h>
 #include "spfs.h"
 #include "spfsimpl.h"
 
+/* maximum number of responses sent with a single writev */
+#define FDCONN_MAXIOV	64
+
 typedef struct Spfdconn Spfdconn;
 struct Spfdconn {
 	int		fdin;
 	int		fdout;
 	Spfd*		spfdin;
 	Spfd*		spfdout;
+	int		seqpacket;	/* a message per packet, no framing */
 };
 
 static void sp_fdconn_notify(Spfd *spfd, void *aux);
 static int sp_fdconn_read(Spconn *conn);
+static int sp_fdconn_read_packets(Spconn *conn);
+static void sp_fdconn_process(Spconn *conn);
 static void sp_fdconn_write(Spconn *conn);
+static void sp_fdconn_write_packets(Spconn *conn);
 static int sp_fdconn_shutdown(Spconn *conn);
 static void sp_fdconn_dataout(Spconn *conn, Spreq *req);
 
 Spconn*
 sp_fdconn_create(Spsrv *srv, int fdin, int fdout)
 {
+	int type, domain;
+	socklen_t len;
 	Spconn *conn;
 	Spfdconn *fdconn;
 
@@ -60,6 +71,19 @@ sp_fdconn_create(Spsrv *srv, int fdin, int fdout)
 	fdconn->fdin = fdin;
 	fdconn->fdout = fdout;
 
+	len = sizeof(type);
+	fdconn->seqpacket = fdin == fdout
+		&& getsockopt(fdin, SOL_SOCKET, SO_TYPE, &type, &len) == 0
+		&& type == SOCK_SEQPACKET;
+
+	/* a packet carries its own fds, so the client knows which
+	   response they go with */
+	len = sizeof(domain);
+	if (fdconn->seqpacket
+	&& getsockopt(fdin, SOL_SOCKET, SO_DOMAIN, &domain, &len) == 0
+	&& domain == PF_UNIX)
+		conn->flags |= Cfdcap;
+
 	fdconn->spfdin = spfd_add(fdin, sp_fdconn_notify, conn);
 	if (!fdconn->spfdin)
 		goto error;
@@ -77,7 +101,13 @@ sp_fdconn_create(Spsrv *srv, int fdin, int fdout)
 	conn->caux = fdconn;
 	conn->shutdown = sp_fdconn_shutdown;
 	conn->dataout = sp_fdconn_dataout;
-	sp_srv_add_conn(srv, conn);
+	if (sp_srv_add_conn(srv, conn) < 0) {
+		spfd_remove(fdconn->spfdin);
+		if (fdconn->spfdout != fdconn->spfdin)
+			spfd_remove(fdconn->spfdout);
+		goto error;
+	}
+
 	return conn;
 
 error:
@@ -138,19 +168,20 @@ sp_fdconn_notify(Spfd *spfd, void *aux)
 static int
 sp_fdconn_read(Spconn *conn)
 {
-	int n, size;
-	Spsrv *srv;
+	int n;
 	Spfcall *fc;
-	Spreq *req;
 	Spfdconn *fdconn;
 
-	srv = conn->srv;
 	fdconn = conn->caux;
 
-	/* if we are sending Enomem error back, block all reading */
-	if (srv->enomem)
+	/* if we are sending Enomem error back, or the client doesn't read
+	   the responses, leave the data in the socket */
+	if (sp_conn_throttle(conn))
 		return 0;
 
+	if (fdconn->seqpacket)
+		return sp_fdconn_read_packets(conn);
+
 	if (!conn->ireqs) {
 		fc = sp_conn_new_incall(conn);
 		if (!fc)
@@ -170,104 +201,251 @@ sp_fdconn_read(Spconn *conn)
 		return 0;
 
 	fc->size += n;
+	sp_fdconn_process(conn);
+	return 0;
+}
 
-again:
-	n = fc->size;
-	if (n < 4)
-		return 0;
-
-	size = fc->pkt[0] | (fc->pkt[1]<<8) | (fc->pkt[2]<<16) | (fc->pkt[3]<<24);
-	if (n < size)
-		return 0;
-
-	if (size > conn->msize) {
-		fprintf(stderr, "error: packet too big\n");
-		close(fdconn->fdin);
-		if (fdconn->fdout != fdconn->fdin)
-			close(fdconn->fdout);
-		return 0;
-	}
-
-	if (!sp_deserialize(fc, fc->pkt, conn->dotu)) {
-		fprintf(stderr, "error while deserializing\n");
-		close(fdconn->fdin);
-		if (fdconn->fdout != fdconn->fdin)
-			close(fdconn->fdout);
-		return 0;
-	}
-
-	if (srv->debuglevel) {
-		fprintf(stderr, "<<< (%p) ", conn);
-		sp_printfcall(stderr, fc, conn->dotu);
-		fprintf(stderr, "\n");
-	}
+/* each packet is a whole message, read them into their own buffers */
+static int
+sp_fdconn_read_packets(Spconn *conn)
+{
+	int i, n, size;
+	Spsrv *srv;
+	Spfcall *fc;
+	Spreq *req;
+	Spfdconn *fdconn;
 
-	req = conn->ireqs;
-	req->tag = req->tcall->tag;
-	conn->ireqs = NULL;
-	if (n > size) {
+	srv = conn->srv;
+	fdconn = conn->caux;
+	for(i = 0; i < FDCONN_MAXIOV && !sp_conn_throttle(conn); i++) {
 		fc = sp_conn_new_incall(conn);
 		if (!fc)
 			return 0;
 
-		fc->size = 0;
-		conn->ireqs = sp_req_alloc(conn, fc);
-		if (!req)
+		n = spfd_read(fdconn->spfdin, fc->pkt, conn->msize);
+		if (n <= 0) {
+			sp_conn_free_incall(conn, fc);
+			return n==0 ? -1 : 0;
+		}
+
+		/* a packet over msize is truncated */
+		size = fc->pkt[0] | (fc->pkt[1]<<8) | (fc->pkt[2]<<16) | (fc->pkt[3]<<24);
+		if (n < 7 || size != n) {
+			fprintf(stderr, "error: bad packet size %d\n", n);
+			sp_conn_free_incall(conn, fc);
+			return -1;
+		}
+
+		fc->size = n;
+		req = sp_req_alloc(conn, fc);
+		if (!req) {
+			sp_conn_free_incall(conn, fc);
 			return 0;
+		}
 
-		memmove(fc->pkt, req->tcall->pkt + size, n - size);
-		fc->size = n - size;
-	}
+		if (!sp_deserialize(fc, fc->pkt, conn->dotu)) {
+			fprintf(stderr, "error while deserializing\n");
+			sp_req_free(req);
+			sp_conn_free_incall(conn, fc);
+			return -1;
+		}
 
-	sp_srv_process_req(req);
-	if (conn->ireqs) {
-		fc = conn->ireqs->tcall;
-		goto again;
+		if (srv->debuglevel) {
+			fprintf(stderr, "<<< (%p) ", conn);
+			sp_printfcall(stderr, fc, conn->dotu);
+			fprintf(stderr, "\n");
+		}
+
+		req->tag = fc->tag;
+		sp_srv_process_req(req);
 	}
 
 	return 0;
 }
 
+/* process the complete messages that are already read */
+static void
+sp_fdconn_process(Spconn *conn)
+{
+	int n, size;
+	Spsrv *srv;
+	Spfcall *fc;
+	Spreq *req;
+	Spfdconn *fdconn;
+
+	srv = conn->srv;
+	fdconn = conn->caux;
+
+	while (conn->ireqs) {
+		if (sp_conn_throttle(conn))
+			return;
+
+		fc = conn->ireqs->tcall;
+		n = fc->size;
+		if (n < 4)
+			return;
+
+		size = fc->pkt[0] | (fc->pkt[1]<<8) | (fc->pkt[2]<<16) | (fc->pkt[3]<<24);
+		if (n < size)
+			return;
+
+		if (size > conn->msize) {
+			fprintf(stderr, "error: packet too big\n");
+			close(fdconn->fdin);
+			if (fdconn->fdout != fdconn->fdin)
+				close(fdconn->fdout);
+			return;
+		}
+
+		if (!sp_deserialize(fc, fc->pkt, conn->dotu)) {
+			fprintf(stderr, "error while deserializing\n");
+			close(fdconn->fdin);
+			if (fdconn->fdout != fdconn->fdin)
+				close(fdconn->fdout);
+			return;
+		}
+
+		if (srv->debuglevel) {
+			fprintf(stderr, "<<< (%p) ", conn);
+			sp_printfcall(stderr, fc, conn->dotu);
+			fprintf(stderr, "\n");
+		}
+
+		req = conn->ireqs;
+		req->tag = req->tcall->tag;
+		conn->ireqs = NULL;
+		if (n > size) {
+			fc = sp_conn_new_incall(conn);
+			if (!fc)
+				return;
+
+			fc->size = 0;
+			conn->ireqs = sp_req_alloc(conn, fc);
+			if (!req)
+				return;
+
+			memmove(fc->pkt, req->tcall->pkt + size, n - size);
+			fc->size = n - size;
+		}
+
+		sp_srv_process_req(req);
+	}
+}
+
+/* write as many of the queued responses as the socket accepts
+   with a single writev */
 static void
 sp_fdconn_write(Spconn *conn)
 {
-	int n;
-	u32 pos;
+	int i, n, resume;
+	u32 pos, len;
 	Spfcall *rc;
 	Spreq *req;
-	Spsrv *srv;
 	Spfdconn *fdconn;
+	struct iovec iov[FDCONN_MAXIOV];
 
 	if (!conn->oreqs)
 		return;
 
-	srv = conn->srv;
 	fdconn = conn->caux;
-	req = conn->oreqs;
-	rc = req->rcall;
-	pos = (int) req->caux;
-	if (conn->srv->debuglevel && pos==0) {
-		fprintf(stderr, ">>> (%p) ", conn);
-		sp_printfcall(stderr, rc, conn->dotu);
-		fprintf(stderr, "\n");
+	if (fdconn->seqpacket) {
+		sp_fdconn_write_packets(conn);
+		return;
+	}
+
+	/* up to two entries per response, see sp_fcall_iov */
+	for(i = 0, req = conn->oreqs; req && i < FDCONN_MAXIOV - 1; req = req->next) {
+		rc = req->rcall;
+		pos = req->wpos;
+		i += sp_fcall_iov(rc, pos, rc->size - pos, &iov[i]);
 	}
 
-	n = spfd_write(fdconn->spfdout, rc->pkt + pos, rc->size - pos);
+	n = spfd_writev(fdconn->spfdout, iov, i);
 	if (n <= 0)
 		return;
 
-	pos += n;
-	req->caux = (void *) pos;
-	if (pos == rc->size) {
-		conn->oreqs = req->next;
-		sp_conn_free_incall(conn, req->tcall);
-		sp_req_free(req);
-		if (rc==srv->rcenomem || rc==srv->rcenomemu) {
-			/* unblock reading and read some messages if we can */
-			srv->enomem = 0;
-			if (spfd_can_read(fdconn->spfdin))
-				sp_fdconn_read(conn);
-		} else
-			free(rc);
+	resume = 0;
+	while (n > 0) {
+		req = conn->oreqs;
+		rc = req->rcall;
+		pos = req->wpos;
+		len = rc->size - pos;
+		if (n < len) {
+			req->wpos = pos + n;
+			break;
+		}
+
+		if (conn->srv->debuglevel) {
+			fprintf(stderr, ">>> (%p) ", conn);
+			sp_printfcall(stderr, rc, conn->dotu);
+			fprintf(stderr, "\n");
+		}
+
+		n -= len;
+		resume |= sp_conn_sent(conn);
 	}
+
+	if (resume) {
+		/* reading was blocked, read some messages if we can */
+		sp_fdconn_process(conn);
+		if (spfd_can_read(fdconn->spfdin))
+			sp_fdconn_read(conn);
+	}
+}
+
+/* send each of the queued responses in a packet of its own, all
+   with a single sendmmsg, with the file passed with the response if any */
+static void
+sp_fdconn_write_packets(Spconn *conn)
+{
+	int i, n, resume;
+	Spfcall *rc;
+	Spreq *req;
+	Spfdconn *fdconn;
+	struct iovec iov[FDCONN_MAXIOV][2];
+	struct mmsghdr msgs[FDCONN_MAXIOV];
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cbufs[FDCONN_MAXIOV];
+	struct cmsghdr *cmsg;
+
+	fdconn = conn->caux;
+	memset(msgs, 0, sizeof(msgs));
+	for(i = 0, req = conn->oreqs; req && i < FDCONN_MAXIOV; i++, req = req->next) {
+		rc = req->rcall;
+		msgs[i].msg_hdr.msg_iov = iov[i];
+		msgs[i].msg_hdr.msg_iovlen = sp_fcall_iov(rc, 0, rc->size, iov[i]);
+		if (req->fd < 0)
+			continue;
+
+		msgs[i].msg_hdr.msg_control = cbufs[i].buf;
+		msgs[i].msg_hdr.msg_controllen = sizeof(cbufs[i].buf);
+		cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &req->fd, sizeof(int));
+	}
+
+	n = sendmmsg(fdconn->fdout, msgs, i, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	/* wait for POLLOUT before sending more */
+	spfd_write(fdconn->spfdout, NULL, 0);
+	if (n <= 0)
+		return;
+
+	resume = 0;
+	for(i = 0; i < n; i++) {
+		if (conn->srv->debuglevel) {
+			fprintf(stderr, ">>> (%p) ", conn);
+			sp_printfcall(stderr, conn->oreqs->rcall, conn->dotu);
+			fprintf(stderr, "\n");
+		}
+
+		resume |= sp_conn_sent(conn);
+	}
+
+	if (resume && spfd_can_read(fdconn->spfdin))
+		sp_fdconn_read(conn);
 }
@@ -845,6 +845,87 @@ sp_set_rread_count(Spfcall *fc, u32 count)
 	buf_put_int32(bufp, count, &fc->count);
 }
 
+/* Rread with the data left where it is, the response holds a reference
+   to ref until it is freed. The transports send it with sp_fcall_iov. */
+Spfcall *
+sp_create_rread_ref(u32 count, u8 *data, Spdata *ref)
+{
+	Spfcall *fc;
+	struct cbuf buffer;
+	struct cbuf *bufp;
+
+	bufp = &buffer;
+	fc = sp_create_common(bufp, 4, Rread);
+	if (!fc)
+		return NULL;
+
+	buf_put_int32(bufp, count, &fc->count);
+	if (!sp_post_check(fc, bufp))
+		return NULL;
+
+	/* the size field covers the data */
+	buf_init(bufp, (char *) fc->pkt, 4);
+	buf_put_int32(bufp, fc->size + count, &fc->size);
+	fc->data = data;
+	fc->dataref = ref;
+	sp_data_incref(ref);
+
+	return fc;
+}
+
+void
+sp_data_incref(Spdata *d)
+{
+	__atomic_add_fetch(&d->ref, 1, __ATOMIC_RELAXED);
+}
+
+void
+sp_data_decref(Spdata *d)
+{
+	if (__atomic_sub_fetch(&d->ref, 1, __ATOMIC_ACQ_REL) == 0)
+		(*d->free)(d);
+}
+
+/* fill iov with the bytes of the message from off to off + len, returns
+   the number of entries used, at most 2 */
+int
+sp_fcall_iov(Spfcall *fc, u32 off, u32 len, struct iovec *iov)
+{
+	int n;
+	u32 pktsize, count;
+
+	n = 0;
+	pktsize = fc->dataref ? fc->size - fc->count : fc->size;
+	if (off < pktsize && len > 0) {
+		count = pktsize - off;
+		if (count > len)
+			count = len;
+
+		iov[n].iov_base = fc->pkt + off;
+		iov[n].iov_len = count;
+		n++;
+		off += count;
+		len -= count;
+	}
+
+	if (len > 0) {
+		iov[n].iov_base = fc->data + (off - pktsize);
+		iov[n].iov_len = len;
+		n++;
+	}
+
+	return n;
+}
+
+void
+sp_fcall_free(Spfcall *fc)
+{
+	if (fc && fc->dataref)
+		sp_data_decref(fc->dataref);
+
+	free(fc);
+}
+
 Spfcall *
 sp_create_twrite(u32 fid, u64 offset, u32 count, u8 *data)
 {
@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <assert.h>
 #include <limits.h>
+#include <time.h>
 #include "spfs.h"
 #include "spfsimpl.h"
 
@@ -55,6 +56,9 @@ struct Spolltbl {
 	Spfd**		spfds;
 	struct pollfd*	fds;
 	Spfd*		pend_spfds;
+	Sptimer*	timers;
+	int		busypoll;	/* usec to spin before blocking */
+	Sppollstats	stats;
 };
 
 struct Spfd {
@@ -67,7 +71,18 @@ struct Spfd {
 	Spfd*		next;	/* list of the fds pending addition */
 };
 
-static Spolltbl ptbl;
+struct Sptimer {
+	int		msec;	/* period */
+	int		flags;
+	long long	expires;
+	void*		aux;
+	void		(*notify)(Sptimer *, void *);
+
+	Sptimer*	next;
+};
+
+/* each thread runs its own loop */
+static __thread Spolltbl ptbl;
 
 /*
 void
@@ -96,6 +111,21 @@ sp_poll_looping()
 	return ptbl.looping;
 }
 
+/* spin for usec with zero timeout polls before blocking in the calling
+   thread's loop, 0 turns it off */
+void
+sp_poll_set_busypoll(int usec)
+{
+	ptbl.busypoll = usec > 0 ? usec : 0;
+}
+
+/* the busy polling counters of the calling thread's loop */
+void
+sp_poll_get_stats(Sppollstats *st)
+{
+	*st = ptbl.stats;
+}
+
 Spfd *
 spfd_add(int fd, void (*notify)(Spfd *, void *), void *aux)
 {
@@ -108,7 +138,7 @@ spfd_add(int fd, void (*notify)(Spfd *, void *), void *aux)
 
 	fcntl(fd, F_SETFL, O_NONBLOCK);
 	spfd->fd = fd;
-	spfd->flags = POLLIN;
+	spfd->flags = 0;
 	spfd->aux = aux;
 	spfd->notify = notify;
 	spfd->pfd = NULL;
@@ -203,6 +233,97 @@ spfd_write(Spfd *spfd, void *buf, int buflen)
 	return ret;
 }
 
+int
+spfd_writev(Spfd *spfd, struct iovec *iov, int iovcnt)
+{
+	int n, ret;
+
+	if (iovcnt)
+		ret = writev(spfd->fd, iov, iovcnt);
+	else
+		ret = 0;
+
+	spfd->flags &= ~Writable;
+	spfd->pfd->events |= POLLOUT;
+
+	if (ret < 0) {
+		n = errno;
+		if (n != EAGAIN)
+			sp_uerror(n);
+	}
+
+	return ret;
+}
+
+static long long
+sp_poll_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+Sptimer *
+sp_timer_add(int msec, void (*notify)(Sptimer *, void *), void *aux)
+{
+	Sptimer *t;
+
+	t = sp_malloc(sizeof(*t));
+	if (!t)
+		return NULL;
+
+	t->msec = msec;
+	t->flags = 0;
+	t->expires = sp_poll_now() + msec;
+	t->aux = aux;
+	t->notify = notify;
+	t->next = ptbl.timers;
+	ptbl.timers = t;
+
+	return t;
+}
+
+void
+sp_timer_remove(Sptimer *t)
+{
+	/* freed by sp_poll_timers, the timer may be firing right now */
+	t->flags |= Removed;
+}
+
+/* run the expired timers, returns msecs until the next one expires */
+static int
+sp_poll_timers(int timeout)
+{
+	long long now;
+	Sptimer *t, **prevp;
+
+	now = sp_poll_now();
+	for(t = ptbl.timers; t != NULL; t = t->next) {
+		if (t->flags & Removed || t->expires > now)
+			continue;
+
+		t->expires = now + t->msec;
+		(*t->notify)(t, t->aux);
+	}
+
+	prevp = &ptbl.timers;
+	while ((t = *prevp) != NULL) {
+		if (t->flags & Removed) {
+			*prevp = t->next;
+			free(t);
+			continue;
+		}
+
+		if (t->expires - now < timeout)
+			timeout = t->expires - now;
+
+		prevp = &t->next;
+	}
+
+	return timeout;
+}
+
 static void
 sp_poll_update_table()
 {
@@ -301,13 +422,58 @@ sp_poll_update_table()
 	ptbl.flags &= ~TblModified;
 }
 
+static long long
+sp_poll_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* poll with zero timeout until there is an event, the busy polling
+   period is over or the next timer is due, returns what poll did and
+   takes the time spent off the timeout */
+static int
+sp_poll_spin(int *timeout)
+{
+	int n;
+	long long start, now, end;
+
+	start = sp_poll_usec();
+	end = start + ptbl.busypoll;
+	if (*timeout > 0 && end > start + *timeout*1000LL)
+		end = start + *timeout*1000LL;
+
+	ptbl.stats.spins++;
+	do {
+		n = poll(ptbl.fds, ptbl.fdnum, 0);
+		now = sp_poll_usec();
+	} while (n == 0 && now < end);
+
+	ptbl.stats.spinusec += now - start;
+	if (n != 0)
+		ptbl.stats.spinhits++;
+	else
+		ptbl.stats.blocks++;
+
+	if (*timeout > 0) {
+		*timeout -= (now - start) / 1000;
+		if (*timeout < 0)
+			*timeout = 0;
+	}
+
+	return n;
+}
+
 void
 sp_poll_once()
 {
-	int i, n, flags;
+	int i, n, flags, timeout;
 	struct pollfd *pfd;
 	struct Spfd *spfd;
 
+	timeout = sp_poll_timers(300000);
 	if (ptbl.flags & TblModified)
 		sp_poll_update_table();
 
@@ -318,7 +484,13 @@ sp_poll_once()
 //			   		(ptbl.fds[i].events & POLLIN) ?"POLLIN" :"",
 //			   		(ptbl.fds[i].events & POLLOUT) ?"POLLOUT" :"");
 
-	n = poll(ptbl.fds, ptbl.fdnum, 300000);
+	n = 0;
+	ptbl.stats.polls++;
+	if (ptbl.busypoll > 0 && timeout != 0)
+		n = sp_poll_spin(&timeout);
+
+	if (n == 0)
+		n = poll(ptbl.fds, ptbl.fdnum, timeout);
 //	fprintf(stderr, "sp_poll_loop fdnum %d result %d\n", ptbl.fdnum, n);
 
 	if (n < 0)
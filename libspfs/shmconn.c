@@ -0,0 +1,563 @@
+/*
+ * Copyright (C) 2006 by Latchesar Ionkov <lucho@ionkov.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * LATCHESAR IONKOV AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "spfs.h"
+#include "spfsimpl.h"
+
+//
+// Shared memory rings for clients on the same host
+//
+// The client creates a memfd holding the ring and two eventfds, and hands
+// them to the server with shmsrv. The memfd has to be sealed with at
+// least F_SEAL_SHRINK, a client truncating the ring under the server
+// would kill it with SIGBUS. The memfd starts with a page of
+// indices, each group on its own cache line, followed by the slots:
+//
+//	magic[4] nslots[4] msize[4]	offset 0
+//	req_prod[4] req_event[4]	offset 64
+//	rsp_prod[4] rsp_event[4]	offset 128
+//	slot[nslots][msize]		offset 4096
+//
+// all in host byte order. As with the Xen rings the requests and the
+// responses share the slots: the client puts a request in slot
+// req_prod % nslots and advances req_prod, the server puts the responses
+// in slot rsp_prod % nslots, after copying the requests out. The server
+// gives back one slot for each request it takes, so the client can have
+// up to nslots requests outstanding. Usually the slot holds the response,
+// but a request can end without one, e.g. when the server drops it, and
+// then the slot holds an empty message, its size is 0, the client skips
+// it. The server gives the slots of those back at the latest when it
+// runs out of requests to read. nslots is a power of 2, a slot holds a
+// message of the server msize.
+//
+// The indices only grow. A side sets its event index to the value of the
+// other side's producer index it wants to be woken up at and rings the
+// doorbell, a write to its eventfd, only if the producer index passes
+// the event index of the other side. The server spins a little waiting
+// for new requests before it sleeps; the time is adapted to how soon
+// after the last sleep the next request came.
+//
+
+#define SHMRING_MAGIC		0x9f5e3a01
+#define SHMRING_SLOTOFF		4096
+
+// usec to spin for the next request, at most
+#define SHMCONN_SPIN		50
+
+typedef struct Shmring Shmring;
+struct Shmring {
+	u32		magic;
+	u32		nslots;
+	u32		msize;
+	u8		pad0[52];
+
+	volatile u32	req_prod;	// client
+	volatile u32	req_event;	// server
+	u8		pad1[56];
+
+	volatile u32	rsp_prod;	// server
+	volatile u32	rsp_event;	// client
+	u8		pad2[56];
+};
+
+typedef struct Spshmconn Spshmconn;
+struct Spshmconn {
+	int sock;		// the client, closed when it is gone
+	int evin;		// doorbells, from and to the client
+	int evout;
+	Spfd *sockspfd;
+	Spfd *evspfd;
+
+	Shmring *ring;
+	size_t ringsize;
+	u8 *slots;
+	u32 nslots;		// the geometry, as checked when mapped
+	u32 msize;
+
+	u32 req_cons;
+	u32 rsp_prod;
+	int inpoll;
+
+	int maxspin;		// usec, 0 doesn't spin
+	int spin;
+	long long slept;	// usec, when the last wait started
+};
+
+static void sp_shmconn_notify(Spfd *spfd, void *aux);
+static void sp_shmconn_sock_notify(Spfd *spfd, void *aux);
+static int sp_shmconn_shutdown(Spconn *conn);
+static void sp_shmconn_dataout(Spconn *conn, Spreq *req);
+static void sp_shmconn_write(Spconn *conn);
+
+static long long
+sp_shmconn_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void
+sp_shmconn_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static Shmring *
+sp_shmconn_map(int memfd, u32 maxmsize, size_t *sizep, u32 *nslotsp, u32 *msizep)
+{
+	// the size can't go down once the ring is checked
+	int seals = fcntl(memfd, F_GET_SEALS);
+	if (seals < 0 || !(seals & F_SEAL_SHRINK))
+	{
+		sp_werror("ring not sealed", EINVAL);
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(memfd, &st) < 0)
+	{
+		sp_suerror("cannot stat ring", errno);
+		return NULL;
+	}
+
+	if (st.st_size < SHMRING_SLOTOFF)
+	{
+		sp_werror("ring too small", EINVAL);
+		return NULL;
+	}
+
+	Shmring *ring = mmap(0, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (ring == MAP_FAILED)
+	{
+		sp_suerror("cannot map ring", errno);
+		return NULL;
+	}
+
+	// the client could change the header later, it's read once here
+	u32 nslots = ring->nslots;
+	u32 msize = ring->msize;
+	if (ring->magic != SHMRING_MAGIC || nslots == 0 || (nslots & (nslots - 1)) != 0 ||
+	    msize < maxmsize || (st.st_size - SHMRING_SLOTOFF) / msize < nslots)
+	{
+		munmap(ring, st.st_size);
+		sp_werror("bad ring", EINVAL);
+		return NULL;
+	}
+
+	*sizep = st.st_size;
+	*nslotsp = nslots;
+	*msizep = msize;
+	return ring;
+}
+
+//
+// Create a connection over the ring in memfd. The connection owns the
+// file descriptors from then on, memfd is closed once it is mapped.
+//
+
+Spconn*
+sp_shmconn_create(Spsrv *srv, int sock, int memfd, int evin, int evout)
+{
+	size_t ringsize;
+	u32 nslots, msize;
+	Shmring *ring = sp_shmconn_map(memfd, srv->msize, &ringsize, &nslots, &msize);
+	if (!ring)
+		return NULL;
+
+	Spconn *conn = sp_conn_create(srv);
+	if (!conn)
+		goto error2;
+
+	Spshmconn *shmconn = sp_malloc(sizeof(*shmconn));
+	if (!shmconn)
+		goto error1;
+
+	shmconn->sock = sock;
+	shmconn->evin = evin;
+	shmconn->evout = evout;
+	shmconn->ring = ring;
+	shmconn->ringsize = ringsize;
+	shmconn->slots = (u8 *)ring + SHMRING_SLOTOFF;
+	shmconn->nslots = nslots;
+	shmconn->msize = msize;
+	shmconn->req_cons = ring->req_prod;
+	shmconn->rsp_prod = shmconn->req_cons;
+	shmconn->maxspin = SHMCONN_SPIN;
+	shmconn->spin = SHMCONN_SPIN;
+	shmconn->slept = 0;
+	shmconn->inpoll = 0;
+
+	ring->rsp_prod = shmconn->rsp_prod;
+	ring->req_event = shmconn->req_cons + 1;
+
+	shmconn->sockspfd = spfd_add(sock, sp_shmconn_sock_notify, conn);
+	if (!shmconn->sockspfd)
+		goto error1;
+
+	shmconn->evspfd = spfd_add(evin, sp_shmconn_notify, conn);
+	if (!shmconn->evspfd)
+	{
+		spfd_remove(shmconn->sockspfd);
+		goto error1;
+	}
+
+	conn->caux = shmconn;
+	conn->shutdown = sp_shmconn_shutdown;
+	conn->dataout = sp_shmconn_dataout;
+	if (sp_srv_add_conn(srv, conn) < 0)
+	{
+		spfd_remove(shmconn->sockspfd);
+		spfd_remove(shmconn->evspfd);
+		goto error1;
+	}
+
+	close(memfd);
+	return conn;
+
+error1:
+	free(shmconn);
+	sp_conn_destroy(conn);
+error2:
+	munmap(ring, ringsize);
+	return NULL;
+}
+
+// usec to spin before the connection sleeps, 0 to never spin
+void
+sp_shmconn_set_spin(Spconn *conn, int maxspin)
+{
+	Spshmconn *shmconn = conn->caux;
+
+	shmconn->maxspin = maxspin;
+	shmconn->spin = maxspin;
+}
+
+static int
+sp_shmconn_shutdown(Spconn *conn)
+{
+	Spshmconn *shmconn = conn->caux;
+
+	spfd_remove(shmconn->sockspfd);
+	spfd_remove(shmconn->evspfd);
+	close(shmconn->sock);
+	close(shmconn->evin);
+	close(shmconn->evout);
+	munmap(shmconn->ring, shmconn->ringsize);
+	free(shmconn);
+
+	return 1;
+}
+
+static u8 *
+sp_shmconn_slot(Spshmconn *shmconn, u32 idx)
+{
+	return shmconn->slots + (size_t)(idx & (shmconn->nslots - 1)) * shmconn->msize;
+}
+
+// requests taken from the ring that won't get a response
+static int
+sp_shmconn_dropped(Spconn *conn)
+{
+	Spshmconn *shmconn = conn->caux;
+
+	return (int)(shmconn->req_cons - shmconn->rsp_prod) - conn->nreqs;
+}
+
+//
+// Copy the new requests out of the ring and process them. Returns -1 if
+// the client broke the ring.
+//
+
+static int
+sp_shmconn_read(Spconn *conn)
+{
+	Spsrv *srv = conn->srv;
+	Spshmconn *shmconn = conn->caux;
+	Shmring *ring = shmconn->ring;
+
+	for (;;)
+	{
+		// a throttled connection reads again once responses are sent
+		if (sp_conn_throttle(conn))
+			return 0;
+
+		u32 prod = ring->req_prod;
+		__sync_synchronize();
+		if (prod == shmconn->req_cons)
+			return 0;
+
+		if (prod - shmconn->req_cons > shmconn->nslots)
+		{
+			fprintf(stderr, "sp_shmconn_read: bad req_prod %u\n", prod);
+			return -1;
+		}
+
+		u8 *p = sp_shmconn_slot(shmconn, shmconn->req_cons);
+		u32 size = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+		if (size < 7 || size > conn->msize)
+		{
+			fprintf(stderr, "sp_shmconn_read: bad message size %u\n", size);
+			return -1;
+		}
+
+		// the request is copied, the client could change it while it
+		// is processed, and the slot is reused for the response
+		Spfcall *fc = sp_conn_new_incall(conn);
+		if (!fc)
+			return 0;
+
+		memcpy(fc->pkt, p, size);
+		shmconn->req_cons++;
+
+		// the size could have changed since it was checked, the
+		// checked one is used
+		fc->pkt[0] = size;
+		fc->pkt[1] = size >> 8;
+		fc->pkt[2] = size >> 16;
+		fc->pkt[3] = size >> 24;
+
+		Spreq *req = sp_req_alloc(conn, fc);
+		if (!req)
+		{
+			sp_conn_free_incall(conn, fc);
+			return 0;
+		}
+
+		if (!sp_deserialize(fc, fc->pkt, conn->dotu))
+		{
+			fprintf(stderr, "error while deserializing\n");
+			sp_req_free(req);
+			sp_conn_free_incall(conn, fc);
+			return -1;
+		}
+
+		if (srv->debuglevel)
+		{
+			fprintf(stderr, "<<< (%p) ", conn);
+			sp_printfcall(stderr, fc, conn->dotu);
+			fprintf(stderr, "\n");
+		}
+
+		sp_srv_process_req(req);
+	}
+}
+
+//
+// Wait a little for more requests. Returns 1 if one came. The client
+// doesn't ring the doorbell meanwhile, req_event is behind.
+//
+
+static int
+sp_shmconn_spin(Spshmconn *shmconn)
+{
+	Shmring *ring = shmconn->ring;
+
+	if (shmconn->spin <= 0)
+		return 0;
+
+	long long start = sp_shmconn_now();
+	do
+	{
+		if (ring->req_prod != shmconn->req_cons)
+		{
+			// worth it, spin longer
+			shmconn->spin *= 2;
+			if (shmconn->spin > shmconn->maxspin)
+				shmconn->spin = shmconn->maxspin;
+			return 1;
+		}
+
+		sp_shmconn_relax();
+	} while (sp_shmconn_now() - start < shmconn->spin);
+
+	shmconn->spin /= 2;
+	return 0;
+}
+
+//
+// Process the requests until the ring stays empty. The responses sent
+// meanwhile don't call it again.
+//
+
+static int
+sp_shmconn_poll(Spconn *conn)
+{
+	Spshmconn *shmconn = conn->caux;
+	Shmring *ring = shmconn->ring;
+
+	shmconn->inpoll = 1;
+	for (;;)
+	{
+		if (sp_shmconn_read(conn) < 0)
+		{
+			shmconn->inpoll = 0;
+			return -1;
+		}
+
+		if (conn->flags & (Cthrottled | Cenomem))
+			break;
+
+		if (sp_shmconn_spin(shmconn))
+			continue;
+
+		// ask for the doorbell, then check again for a request that
+		// came before the client could see it
+		ring->req_event = shmconn->req_cons + 1;
+		__sync_synchronize();
+		if (ring->req_prod == shmconn->req_cons)
+		{
+			shmconn->slept = sp_shmconn_now();
+			break;
+		}
+	}
+
+	// the responses are in the ring already, not the dropped requests
+	if (sp_shmconn_dropped(conn) > 0)
+		sp_shmconn_write(conn);
+
+	shmconn->inpoll = 0;
+	return 0;
+}
+
+static void
+sp_shmconn_notify(Spfd *spfd, void *aux)
+{
+	Spconn *conn = aux;
+	Spshmconn *shmconn = conn->caux;
+
+	if (!spfd_can_read(spfd))
+		return;
+
+	u64 v;
+	spfd_read(spfd, &v, sizeof(v));
+
+	//
+	// If the request came soon after the connection went to sleep,
+	// spinning for that long next time saves the wakeup.
+	//
+
+	if (shmconn->maxspin > 0 && shmconn->slept != 0)
+	{
+		long long d = sp_shmconn_now() - shmconn->slept;
+		if (d < shmconn->maxspin && shmconn->spin < 2 * d)
+			shmconn->spin = (2 * d < shmconn->maxspin) ?2 * d :shmconn->maxspin;
+	}
+
+	if (sp_shmconn_poll(conn) < 0)
+		sp_conn_shutdown(conn);
+}
+
+// the socket only tells when the client is gone
+static void
+sp_shmconn_sock_notify(Spfd *spfd, void *aux)
+{
+	Spconn *conn = aux;
+
+	char buf[64];
+	if (spfd_has_error(spfd) || (spfd_can_read(spfd) && spfd_read(spfd, buf, sizeof(buf)) == 0))
+		sp_conn_shutdown(conn);
+}
+
+//
+// Put the responses in the ring. All of them fit, the client has a slot
+// for each request and the slots hold srv->msize.
+//
+
+static void
+sp_shmconn_write(Spconn *conn)
+{
+	Spshmconn *shmconn = conn->caux;
+	Shmring *ring = shmconn->ring;
+
+	u32 old = shmconn->rsp_prod;
+	int resume = 0;
+	while (conn->oreqs)
+	{
+		Spfcall *rc = conn->oreqs->rcall;
+		struct iovec iov[2];
+		u8 *p = sp_shmconn_slot(shmconn, shmconn->rsp_prod);
+		int i, n = sp_fcall_iov(rc, 0, rc->size, iov);
+		for (i = 0; i < n; i++)
+		{
+			memcpy(p, iov[i].iov_base, iov[i].iov_len);
+			p += iov[i].iov_len;
+		}
+		shmconn->rsp_prod++;
+
+		if (conn->srv->debuglevel)
+		{
+			fprintf(stderr, ">>> (%p) ", conn);
+			sp_printfcall(stderr, rc, conn->dotu);
+			fprintf(stderr, "\n");
+		}
+
+		resume |= sp_conn_sent(conn);
+	}
+
+	// give the slots of the dropped requests back
+	int n;
+	for (n = sp_shmconn_dropped(conn); n > 0; n--)
+	{
+		u8 *p = sp_shmconn_slot(shmconn, shmconn->rsp_prod);
+		memset(p, 0, 4);
+		shmconn->rsp_prod++;
+	}
+
+	u32 new = shmconn->rsp_prod;
+	__sync_synchronize();
+	ring->rsp_prod = new;
+	__sync_synchronize();
+	if ((u32)(new - ring->rsp_event) < (u32)(new - old))
+	{
+		u64 one = 1;
+		if (write(shmconn->evout, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			fprintf(stderr, "sp_shmconn_write: doorbell: %d\n", errno);
+	}
+
+	// reading was blocked, read the requests waiting in the ring
+	if (resume && !shmconn->inpoll && sp_shmconn_poll(conn) < 0)
+		sp_conn_shutdown(conn);
+}
+
+static void
+sp_shmconn_dataout(Spconn *conn, Spreq *req)
+{
+	if (req != conn->oreqs)
+		return;
+
+	sp_shmconn_write(conn);
+}
+
+//EOF
@@ -0,0 +1,395 @@
+/*
+ * Copyright (C) 2006 by Latchesar Ionkov <lucho@ionkov.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * LATCHESAR IONKOV AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "spfs.h"
+#include "spfsimpl.h"
+
+//
+// Clients on the same host connect to a unix socket and send the memfd
+// of their ring and two eventfds, the doorbells to and from the server,
+// in one message with SCM_RIGHTS. The server answers with its msize, the
+// socket stays open until the client is gone. See shmconn.c for the ring.
+//
+
+// msec a client has to send the ring after it connects
+#define SHMSRV_PENDTIMEOUT	5000
+
+// msec the socket isn't polled after accept fails
+#define SHMSRV_PAUSE		100
+
+typedef struct Shmsrv Shmsrv;
+typedef struct Shmpend Shmpend;
+
+struct Shmsrv {
+	char *path;
+	int sock;
+	Spfd *spfd;
+	Sptimer *pause;		// polling the socket again when it fires
+	int spin;		// usec, for the connections
+	int npend;		// clients that haven't sent the ring yet
+};
+
+// a client that hasn't sent the ring yet
+struct Shmpend {
+	Spsrv *srv;
+	int sock;
+	Spfd *spfd;
+	Sptimer *timer;		// gives up on the client
+};
+
+static void sp_shmsrv_notify(Spfd *spfd, void *aux);
+static void sp_shmsrv_start(Spsrv *srv);
+static void sp_shmsrv_shutdown(Spsrv *srv);
+static void sp_shmsrv_destroy(Spsrv *srv);
+
+Spsrv*
+sp_shmsrv_create(char *path)
+{
+	struct sockaddr_un saddr;
+	if (strlen(path) >= sizeof(saddr.sun_path))
+	{
+		sp_werror("socket path too long", ENAMETOOLONG);
+		return NULL;
+	}
+
+	Shmsrv *ss = sp_malloc(sizeof(*ss));
+	if (!ss)
+		return NULL;
+
+	ss->spin = -1;
+	ss->npend = 0;
+	ss->spfd = NULL;
+	ss->pause = NULL;
+	ss->path = strdup(path);
+	if (!ss->path)
+	{
+		sp_werror(Enomem, ENOMEM);
+		goto error2;
+	}
+
+	ss->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (ss->sock < 0)
+	{
+		sp_suerror("cannot create socket", errno);
+		goto error2;
+	}
+
+	// a socket left by a previous run
+	unlink(path);
+
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sun_family = AF_UNIX;
+	strcpy(saddr.sun_path, path);
+	if (bind(ss->sock, (struct sockaddr *)&saddr, sizeof(saddr)) < 0)
+	{
+		sp_suerror("cannot bind socket", errno);
+		goto error1;
+	}
+
+	if (listen(ss->sock, SOMAXCONN) < 0)
+	{
+		sp_suerror("cannot listen on socket", errno);
+		goto error1;
+	}
+
+	Spsrv *srv = sp_srv_create();
+	if (!srv)
+		goto error1;
+
+	srv->srvaux = ss;
+	srv->start = sp_shmsrv_start;
+	srv->shutdown = sp_shmsrv_shutdown;
+	srv->destroy = sp_shmsrv_destroy;
+
+	return srv;
+
+error1:
+	close(ss->sock);
+error2:
+	free(ss->path);
+	free(ss);
+	return NULL;
+}
+
+// usec the connections spin for requests before sleeping, 0 to not spin
+void
+sp_shmsrv_set_spin(Spsrv *srv, int spin)
+{
+	Shmsrv *ss = srv->srvaux;
+
+	ss->spin = spin;
+}
+
+static void
+sp_shmsrv_start(Spsrv *srv)
+{
+	Shmsrv *ss = srv->srvaux;
+
+	ss->spfd = spfd_add(ss->sock, sp_shmsrv_notify, srv);
+}
+
+static void
+sp_shmsrv_shutdown(Spsrv *srv)
+{
+	Shmsrv *ss = srv->srvaux;
+
+	if (ss->pause)
+		sp_timer_remove(ss->pause);
+	if (ss->spfd)
+		spfd_remove(ss->spfd);
+	close(ss->sock);
+	unlink(ss->path);
+}
+
+static void
+sp_shmsrv_destroy(Spsrv *srv)
+{
+	Shmsrv *ss = srv->srvaux;
+
+	free(ss->path);
+	free(ss);
+	srv->srvaux = NULL;
+}
+
+static void
+sp_shmsrv_pend_free(Shmpend *sp)
+{
+	Shmsrv *ss = sp->srv->srvaux;
+
+	sp_timer_remove(sp->timer);
+	ss->npend--;
+	free(sp);
+}
+
+static void
+sp_shmsrv_pend_close(Shmpend *sp)
+{
+	if (sp->spfd)
+		spfd_remove(sp->spfd);
+	close(sp->sock);
+	sp_shmsrv_pend_free(sp);
+}
+
+// the client didn't send the ring in time
+static void
+sp_shmsrv_pend_timeout(Sptimer *t, void *aux)
+{
+	Shmpend *sp = aux;
+
+	if (sp->srv->debuglevel)
+		fprintf(stderr, "sp_shmsrv: client timed out\n");
+
+	sp_shmsrv_pend_close(sp);
+}
+
+// the client sent its ring
+static void
+sp_shmsrv_pend_notify(Spfd *spfd, void *aux)
+{
+	Shmpend *sp = aux;
+	Spsrv *srv = sp->srv;
+	Shmsrv *ss = srv->srvaux;
+
+	if (spfd_has_error(spfd))
+	{
+		sp_shmsrv_pend_close(sp);
+		return;
+	}
+
+	if (!spfd_can_read(spfd))
+		return;
+
+	spfd_read(spfd, NULL, 0);
+
+	u8 b;
+	struct iovec iov = { &b, 1 };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} cbuf;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+
+	int n = recvmsg(sp->sock, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	int fds[3];
+	int nfds = 0;
+	struct cmsghdr *cmsg;
+	for (cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		int *cfds = (int *)CMSG_DATA(cmsg);
+		int i;
+		for (i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++)
+			if (nfds < 3)
+				fds[nfds++] = cfds[i];
+			else
+				close(cfds[i]);
+	}
+
+	Spconn *conn = NULL;
+	if (nfds == 3 && !(msg.msg_flags & MSG_CTRUNC))
+	{
+		// the connection takes over the socket
+		spfd_remove(sp->spfd);
+		conn = sp_shmconn_create(srv, sp->sock, fds[0], fds[1], fds[2]);
+		if (!conn)
+			sp->spfd = NULL;
+	}
+
+	if (!conn)
+	{
+		if (sp_haserror())
+		{
+			char *ename;
+			int ecode;
+			sp_rerror(&ename, &ecode);
+			fprintf(stderr, "sp_shmsrv: client refused: %s\n", ename);
+			sp_werror(NULL, 0);
+		}
+
+		int i;
+		for (i = 0; i < nfds; i++)
+			close(fds[i]);
+
+		sp_shmsrv_pend_close(sp);
+		return;
+	}
+
+	if (ss->spin >= 0)
+		sp_shmconn_set_spin(conn, ss->spin);
+
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	char buf[64];
+	if (getsockopt(sp->sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+	{
+		snprintf(buf, sizeof(buf), "shm!%d", cred.pid);
+		conn->address = strdup(buf);
+	}
+
+	u32 msize = srv->msize;
+	if (send(sp->sock, &msize, sizeof(msize), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		fprintf(stderr, "sp_shmsrv: cannot answer client: %d\n", errno);
+
+	sp_shmsrv_pend_free(sp);
+}
+
+static void
+sp_shmsrv_resume(Sptimer *t, void *aux)
+{
+	Spsrv *srv = aux;
+	Shmsrv *ss = srv->srvaux;
+
+	sp_timer_remove(t);
+	ss->pause = NULL;
+	ss->spfd = spfd_add(ss->sock, sp_shmsrv_notify, srv);
+}
+
+static void
+sp_shmsrv_notify(Spfd *spfd, void *aux)
+{
+	Spsrv *srv = aux;
+	Shmsrv *ss = srv->srvaux;
+
+	if (!spfd_can_read(spfd))
+		return;
+
+	spfd_read(spfd, NULL, 0);
+
+	for (;;)
+	{
+		int csock = accept4(ss->sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (csock < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			// out of file descriptors or memory, the socket stays
+			// readable, don't spin on it
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				ss->pause = sp_timer_add(SHMSRV_PAUSE, sp_shmsrv_resume, srv);
+				if (ss->pause)
+				{
+					spfd_remove(ss->spfd);
+					ss->spfd = NULL;
+				}
+			}
+			return;
+		}
+
+		// the clients on their way count as connections
+		if (srv->maxconns && srv->nconns + ss->npend >= srv->maxconns)
+		{
+			close(csock);
+			continue;
+		}
+
+		Shmpend *sp = sp_malloc(sizeof(*sp));
+		if (!sp)
+		{
+			close(csock);
+			continue;
+		}
+
+		sp->srv = srv;
+		sp->sock = csock;
+		sp->timer = sp_timer_add(SHMSRV_PENDTIMEOUT, sp_shmsrv_pend_timeout, sp);
+		if (!sp->timer)
+		{
+			close(csock);
+			free(sp);
+			continue;
+		}
+
+		sp->spfd = spfd_add(csock, sp_shmsrv_pend_notify, sp);
+		if (!sp->spfd)
+		{
+			sp_timer_remove(sp->timer);
+			close(csock);
+			free(sp);
+			continue;
+		}
+
+		ss->npend++;
+	}
+}
+
+//EOF
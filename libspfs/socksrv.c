@@ -20,18 +20,24 @@
  * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
  * DEALINGS IN THE SOFTWARE.
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include "spfs.h"
 #include "spfsimpl.h"
 
+/* msecs the listening socket isn't polled after accept fails */
+#define SOCKSRV_PAUSE	100
+
 typedef struct Socksrv Socksrv;
 
 struct Socksrv {
@@ -40,10 +46,16 @@ struct Socksrv {
 	int			proto;
 	struct sockaddr*	saddr;
 	int			saddrlen;
+	int			backlog;
+	int			rcvbuf;
+	int			sndbuf;
+	int			nodelay;
+	int			busypoll;	/* SO_BUSY_POLL usec of the connections */
 	
 	int			sock;
 	int			shutdown;
 	Spfd*			spfd;
+	Sptimer*		pause;		/* polling again when it fires */
 };
 
 static void sp_socksrv_notify(Spfd *spfd, void *aux);
@@ -55,7 +67,6 @@ static Socksrv*
 sp_socksrv_create_common(int domain, int type, int proto)
 {
 	Socksrv *ss;
-	int flag = 1;
 
 	ss = sp_malloc(sizeof(*ss));
 	if (!ss) 
@@ -64,15 +75,15 @@ sp_socksrv_create_common(int domain, int type, int proto)
 	ss->domain = domain;
 	ss->type = type;
 	ss->proto = proto;
+	ss->backlog = SOMAXCONN;
+	ss->rcvbuf = 0;
+	ss->sndbuf = 0;
+	ss->nodelay = 1;
+	ss->busypoll = 0;
 	ss->shutdown = 0;
-	ss->sock = socket(domain, type, proto);
-	if (ss->sock < 0) {
-		sp_suerror("cannot create socket", errno);
-		free(ss);
-		return NULL;
-	}
-
-	setsockopt(ss->sock, SOL_SOCKET, SO_REUSEADDR, (char *)&flag, sizeof(int));
+	ss->sock = -1;
+	ss->spfd = NULL;
+	ss->pause = NULL;
 
 	return ss;
 }
@@ -80,6 +91,8 @@ sp_socksrv_create_common(int domain, int type, int proto)
 static int
 sp_socksrv_connect(Socksrv *ss)
 {
+	int flag = 1;
+
 	ss->sock = socket(ss->domain, ss->type, ss->proto);
 	if (ss->sock < 0) {
 		sp_suerror("cannot connect socket", errno);
@@ -87,13 +100,28 @@ sp_socksrv_connect(Socksrv *ss)
 	}
 
 	fcntl(ss->sock, F_SETFD, FD_CLOEXEC);
+	fcntl(ss->sock, F_SETFL, O_NONBLOCK);
+	setsockopt(ss->sock, SOL_SOCKET, SO_REUSEADDR, (char *)&flag, sizeof(int));
+
+	/* a socket left by a previous run */
+	if (ss->domain == PF_UNIX)
+		unlink(((struct sockaddr_un *) ss->saddr)->sun_path);
+
+	/* accepted sockets inherit the buffer sizes */
+	if (ss->rcvbuf)
+		setsockopt(ss->sock, SOL_SOCKET, SO_RCVBUF, &ss->rcvbuf, sizeof(int));
+	if (ss->sndbuf)
+		setsockopt(ss->sock, SOL_SOCKET, SO_SNDBUF, &ss->sndbuf, sizeof(int));
+
 	if (bind(ss->sock, ss->saddr, ss->saddrlen) < 0) {
 		sp_suerror("cannot bind socket", errno);
+		close(ss->sock);
 		return -1;
 	}
 
-	if (listen(ss->sock, 1) < 0) {
+	if (listen(ss->sock, ss->backlog) < 0) {
 		sp_suerror("cannot listen on socket", errno);
+		close(ss->sock);
 		return -1;
 	}
 
@@ -154,6 +182,92 @@ sp_socksrv_create_tcp(int *port)
 	return srv;
 }
 
+/* type is SOCK_STREAM or SOCK_SEQPACKET, a message per packet */
+Spsrv*
+sp_socksrv_create_unix(char *path, int type)
+{
+	Spsrv *srv;
+	Socksrv *ss;
+	struct sockaddr_un* saddr;
+
+	if (strlen(path) >= sizeof(saddr->sun_path)) {
+		sp_werror("socket path too long", ENAMETOOLONG);
+		return NULL;
+	}
+
+	ss = sp_socksrv_create_common(PF_UNIX, type, 0);
+	if (!ss)
+		return NULL;
+
+	saddr = sp_malloc(sizeof(*saddr));
+	if (!saddr) {
+		free(ss);
+		return NULL;
+	}
+
+	memset(saddr, 0, sizeof(*saddr));
+	saddr->sun_family = AF_UNIX;
+	strcpy(saddr->sun_path, path);
+	ss->saddr = (struct sockaddr *) saddr;
+	ss->saddrlen = sizeof(*saddr);
+	if (sp_socksrv_connect(ss) < 0) {
+		free(saddr);
+		free(ss);
+		return NULL;
+	}
+
+	srv = sp_srv_create();
+	if (!srv) {
+		close(ss->sock);
+		free(ss->saddr);
+		free(ss);
+		return NULL;
+	}
+
+	srv->srvaux = ss;
+	srv->start = sp_socksrv_start;
+	srv->shutdown = sp_socksrv_shutdown;
+	srv->destroy = sp_socksrv_destroy;
+
+	return srv;
+}
+
+void
+sp_socksrv_set_backlog(Spsrv *srv, int backlog)
+{
+	Socksrv *ss;
+
+	ss = srv->srvaux;
+	ss->backlog = backlog>0?backlog:SOMAXCONN;
+}
+
+void
+sp_socksrv_set_bufsize(Spsrv *srv, int rcvbuf, int sndbuf)
+{
+	Socksrv *ss;
+
+	ss = srv->srvaux;
+	ss->rcvbuf = rcvbuf;
+	ss->sndbuf = sndbuf;
+}
+
+void
+sp_socksrv_set_nodelay(Spsrv *srv, int nodelay)
+{
+	Socksrv *ss;
+
+	ss = srv->srvaux;
+	ss->nodelay = nodelay;
+}
+
+void
+sp_socksrv_set_busypoll(Spsrv *srv, int usec)
+{
+	Socksrv *ss;
+
+	ss = srv->srvaux;
+	ss->busypoll = usec;
+}
 
 static void
 sp_socksrv_start(Spsrv *srv)
@@ -162,6 +276,14 @@ sp_socksrv_start(Spsrv *srv)
 
 	ss = srv->srvaux;
 
+	/* the socket is already listening, apply the configured 
+	   backlog and buffer sizes */
+	if (ss->rcvbuf)
+		setsockopt(ss->sock, SOL_SOCKET, SO_RCVBUF, &ss->rcvbuf, sizeof(int));
+	if (ss->sndbuf)
+		setsockopt(ss->sock, SOL_SOCKET, SO_SNDBUF, &ss->sndbuf, sizeof(int));
+	listen(ss->sock, ss->backlog);
+
 	ss->spfd = spfd_add(ss->sock, sp_socksrv_notify, srv);
 }
 
@@ -172,8 +294,13 @@ sp_socksrv_shutdown(Spsrv *srv)
 
 	ss = srv->srvaux;
 	ss->shutdown = 1;
-	spfd_remove(ss->spfd);
+	if (ss->pause)
+		sp_timer_remove(ss->pause);
+	if (ss->spfd)
+		spfd_remove(ss->spfd);
 	close(ss->sock);
+	if (ss->domain == PF_UNIX)
+		unlink(((struct sockaddr_un *) ss->saddr)->sun_path);
 }
 
 static void
@@ -186,6 +313,37 @@ sp_socksrv_destroy(Spsrv *srv)
 	srv->srvaux = NULL;
 }
 
+static void
+sp_socksrv_setup(Socksrv *ss, int csock)
+{
+	int flag;
+
+	if (ss->domain!=PF_INET || ss->type!=SOCK_STREAM)
+		return;
+
+	flag = 1;
+	if (ss->nodelay)
+		setsockopt(csock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+	if (ss->busypoll > 0)
+		setsockopt(csock, SOL_SOCKET, SO_BUSY_POLL, &ss->busypoll, sizeof(int));
+
+	setsockopt(csock, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof(flag));
+}
+
+static void
+sp_socksrv_resume(Sptimer *t, void *aux)
+{
+	Spsrv *srv;
+	Socksrv *ss;
+
+	srv = aux;
+	ss = srv->srvaux;
+	sp_timer_remove(t);
+	ss->pause = NULL;
+	ss->spfd = spfd_add(ss->sock, sp_socksrv_notify, srv);
+}
+
 static void
 sp_socksrv_notify(Spfd *spfd, void *aux)
 {
@@ -193,7 +351,9 @@ sp_socksrv_notify(Spfd *spfd, void *aux)
 	Spsrv *srv;
 	Spconn *conn;
 	Socksrv *ss;
-	struct sockaddr_in caddr;
+	struct sockaddr_storage caddr;
+	struct sockaddr_in *sin;
+	struct ucred cred;
 	socklen_t caddrlen;
 	char buf[64];
 
@@ -204,22 +364,57 @@ sp_socksrv_notify(Spfd *spfd, void *aux)
 		return;
 
 	spfd_read(spfd, buf, 0);
-	caddrlen = sizeof(caddr);
-	csock = accept(ss->sock, (struct sockaddr *) &caddr, &caddrlen);
-	if (csock<0) {
-		if (!ss->shutdown)
-			return;
 
-		close(ss->sock);
-		if (sp_socksrv_connect(ss) < 0)
-			fprintf(stderr, "error while reconnecting: %d\n", errno);
-		return;
+	/* drain the accept queue, a burst of clients reconnecting
+	   shouldn't wait for a poll round each */
+	for(;;) {
+		caddrlen = sizeof(caddr);
+		csock = accept4(ss->sock, (struct sockaddr *) &caddr, &caddrlen,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (csock < 0) {
+			if (errno==EINTR || errno==ECONNABORTED)
+				continue;
+
+			if (errno==EAGAIN || errno==EWOULDBLOCK)
+				return;
+
+			/* out of file descriptors or memory, the client stays
+			   in the queue and the socket readable, stop polling
+			   it for a while instead of spinning */
+			if (!ss->shutdown) {
+				if (srv->debuglevel)
+					fprintf(stderr, "accept: %d, pausing\n", errno);
+
+				ss->pause = sp_timer_add(SOCKSRV_PAUSE, sp_socksrv_resume, srv);
+				if (ss->pause) {
+					spfd_remove(ss->spfd);
+					ss->spfd = NULL;
+				}
+				return;
+			}
+
+			close(ss->sock);
+			if (sp_socksrv_connect(ss) < 0)
+				fprintf(stderr, "error while reconnecting: %d\n", errno);
+			return;
+		}
+
+		sp_socksrv_setup(ss, csock);
+		if (!(conn = sp_fdconn_create(srv, csock, csock))) {
+			close(csock);
+			continue;
+		}
+
+		if (ss->domain == PF_UNIX) {
+			/* the peer socket has no name, use the pid */
+			caddrlen = sizeof(cred);
+			if (getsockopt(csock, SOL_SOCKET, SO_PEERCRED, &cred, &caddrlen) < 0)
+				cred.pid = 0;
+			snprintf(buf, sizeof(buf), "unix!%d", cred.pid);
+		} else {
+			sin = (struct sockaddr_in *) &caddr;
+			snprintf(buf, sizeof(buf), "%s!%d", inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
+		}
+		conn->address = strdup(buf);
 	}
-
-	fcntl(csock, F_SETFD, FD_CLOEXEC);
-	if (!(conn = sp_fdconn_create(srv, csock, csock)))
-		close(csock);
-
-	snprintf(buf, sizeof(buf), "%s!%d", inet_ntoa(caddr.sin_addr), ntohs(caddr.sin_port));
-	conn->address = strdup(buf);
 }
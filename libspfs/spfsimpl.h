@@ -21,10 +21,79 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
-/* ethsrv.c and ethconn.c */
+/* ethsrv2.c and ethconn2.c */
 
 #define EXP_9P_ETH		0x885b
 
+/* crc32c.c */
+u32 sp_crc32c(u32 crc, u8 *buf, int len);
+
+/* ethframe.c */
+#define ETHFRAME_MAGIC		0x9f50fa01
+#define ETHFRAME_HDRSZ		16
+#define ETHFRAME_RELHDRSZ	24
+#define ETHFRAME_MAXHDRSZ	28	/* with seq, ack and credit */
+
+enum {
+	/* Ethframe flags */
+	ETHFRAME_REL	= 1,	/* seq and ack follow the header */
+	ETHFRAME_ACK	= 2,	/* ack only, no message */
+	ETHFRAME_SYN	= 4,	/* first message of the session */
+	ETHFRAME_CSUM	= 8,	/* the csum field holds the CRC32C of the frame */
+	ETHFRAME_CRED	= 16,	/* credit follows the header */
+	ETHFRAME_PACK	= 32,	/* several whole messages, back to back */
+};
+
+typedef struct Ethframe Ethframe;
+typedef struct Ethrasm Ethrasm;
+
+struct Ethframe {
+	u16		tag;
+	u16		flags;
+	u32		offset;
+	u32		total;
+	u32		seq;
+	u32		ack;
+	u32		credit;
+	u8*		data;
+	int		count;
+};
+
+/* fragments received out of order, kept apart */
+#define ETHRASM_NRANGES	8
+
+/* a message being reassembled */
+struct Ethrasm {
+	Spfcall*	fc;
+	u16		tag;
+	u32		total;
+	u32		stamp;
+	int		nranges;	/* the bytes received, sorted, not touching */
+	u32		start[ETHRASM_NRANGES];
+	u32		end[ETHRASM_NRANGES];
+};
+
+int sp_ethframe_parse(u8 *buf, int len, Ethframe *f);
+int sp_ethframe_put(u8 *buf, Ethframe *f);
+Spfcall *sp_ethframe_reassemble(Spconn *conn, Ethrasm *rasm, int nrasm, Ethframe *f);
+void sp_ethframe_reset(Spconn *conn, Ethrasm *rasm, int nrasm);
+
+/* ethxdp.c */
+typedef struct Ethxdp Ethxdp;
+struct mmsghdr;
+
+Ethxdp *sp_ethxdp_create(int ifindex, int queue, u8 *haddr, u16 proto, int flags);
+void sp_ethxdp_destroy(Ethxdp *x);
+int sp_ethxdp_fd(Ethxdp *x);
+int sp_ethxdp_maxframe(Ethxdp *x);
+int sp_ethxdp_recv(Ethxdp *x, u8 **bufs, int *lens, int max);
+void sp_ethxdp_release(Ethxdp *x);
+int sp_ethxdp_send(Ethxdp *x, struct mmsghdr *msgs, int n);
+
+/* ethsrv2.c */
+void sp_ethsrv2_remove_conn(Spsrv *srv, Spconn *conn, void *sap);
+void sp_ethsrv2_dataout(Spsrv *srv, Spconn *conn, void *sap);
+
 /* fcall.c */
 Spfcall *sp_version(Spreq *req, Spfcall *tc);
 Spfcall *sp_auth(Spreq *req, Spfcall *tc);
@@ -43,8 +112,6 @@ Spfcall *sp_wstat(Spreq *req, Spfcall *tc);
 /* srv.c */
 void sp_srv_add_req(Spsrv *srv, Spreq *req);
 void sp_srv_remove_req(Spsrv *srv, Spreq *req);
-void sp_srv_add_workreq(Spsrv *srv, Spreq *req);
-void sp_srv_remove_workreq(Spsrv *srv, Spreq *req);
 
 /* fmt.c */
 int sp_printstat(FILE *f, Spstat *st, int dotu);
@@ -53,3 +120,7 @@ int sp_dump(FILE *f, u8 *data, int datalen);
 /* conn.c */
 Spfcall *sp_conn_new_incall(Spconn *conn);
 void sp_conn_free_incall(Spconn *, Spfcall *);
+Spfcall *sp_conn_swap_incall(Spconn *conn, Spfcall *fc, u32 size);
+void sp_conn_add_workreq(Spconn *conn, Spreq *req);
+void sp_conn_remove_workreq(Spconn *conn, Spreq *req);
+Spreq *sp_conn_find_workreq(Spconn *conn, u16 tag);
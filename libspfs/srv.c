@@ -23,15 +23,17 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
 #include "spfs.h"
 #include "spfsimpl.h"
 
 struct Reqpool {
 	int		reqnum;
 	Spreq*		reqlist;
-} reqpool = { 0, NULL };
+} __thread reqpool = { 0, NULL };
 
 static Spfcall* sp_default_version(Spconn *, u32, Spstr *);
 static Spfcall* sp_default_attach(Spfid *, Spfid *, Spstr *, Spstr *);
@@ -68,6 +70,7 @@ sp_srv_create()
 	srv->connopen = NULL;
 	srv->connclose = NULL;
 	srv->fiddestroy = NULL;
+	srv->openfd = NULL;
 
 	srv->version = sp_default_version;
 	srv->attach = sp_default_attach;
@@ -83,86 +86,109 @@ sp_srv_create()
 	srv->stat = sp_default_stat;
 	srv->wstat = sp_default_wstat;
 
+	srv->maxconns = 0;
+	srv->conntimeout = 0;
+	srv->maxreqs = 256;
+	srv->maxobytes = 1024*1024;
+	srv->maxmem = 4*1024*1024;
 	srv->conns = NULL;
-	srv->workreqs = NULL;
+	srv->nconns = 0;
+	srv->reaper = NULL;
 	srv->debuglevel = 0;
 
-	srv->enomem = 0;
-	srv->rcenomem = sp_create_rerror(Enomem, ENOMEM, 0);
-	srv->rcenomemu = sp_create_rerror(Enomem, ENOMEM, 1);
+	return srv;
+}
 
-	if (!srv->rcenomem || !srv->rcenomemu) {
-		free(srv);
-		return NULL;
+static void
+sp_srv_reap_conns(Sptimer *t, void *aux)
+{
+	int n;
+	time_t now;
+	Spsrv *srv;
+	Spconn *conn, *conn1;
+
+	srv = aux;
+	now = time(NULL);
+	n = 0;
+	for(conn = srv->conns; conn != NULL; conn = conn1) {
+		conn1 = conn->next;
+		if (conn->workreqs || conn->oreqs)
+			continue;
+
+		if (now - conn->atime < srv->conntimeout)
+			continue;
+
+		if (srv->debuglevel)
+			fprintf(stderr, "closing idle connection %p %s\n", conn,
+				conn->address?conn->address:"");
+
+		sp_conn_shutdown(conn);
+		n++;
 	}
 
-	return srv;
+	if (n && srv->debuglevel)
+		fprintf(stderr, "closed %d idle connections, %d left\n", n, srv->nconns);
 }
 
 void
 sp_srv_start(Spsrv *srv)
 {
+	int msec;
+
+	if (srv->conntimeout > 0) {
+		msec = srv->conntimeout * 1000 / 2;
+		srv->reaper = sp_timer_add(msec, sp_srv_reap_conns, srv);
+	}
+
 	(*srv->start)(srv);
 }
 
 int
 sp_srv_add_conn(Spsrv *srv, Spconn *conn)
 {
-	int ret;
+	if (srv->maxconns && srv->nconns >= srv->maxconns) {
+		sp_werror(Etoomanyconns, EAGAIN);
+		return -1;
+	}
 
-	ret = 0;
 	conn->srv = srv;
+	conn->atime = time(NULL);
+	conn->prev = NULL;
 	conn->next = srv->conns;
+	if (srv->conns)
+		srv->conns->prev = conn;
 	srv->conns = conn;
+	srv->nconns++;
 
 	if (srv->connopen)
 		(*srv->connopen)(conn);
 
-	return ret;
+	return 0;
 }
 
 void
 sp_srv_remove_conn(Spsrv *srv, Spconn *conn)
 {
-	Spconn *c, *pc;
+	/* not added to the server */
+	if (!conn->prev && srv->conns != conn)
+		return;
+
+	if (conn->prev)
+		conn->prev->next = conn->next;
+	else
+		srv->conns = conn->next;
 
-	for(pc=NULL, c=srv->conns; c!=NULL; pc=c, c=c->next)
-		if (c == conn) {
-			if (pc)
-				pc->next = c->next;
-			else
-				srv->conns = c->next;
+	if (conn->next)
+		conn->next->prev = conn->prev;
 
-			break;
-		}
+	conn->next = NULL;
+	conn->prev = NULL;
+	srv->nconns--;
 
 	if (srv->connclose)
 		(*srv->connclose)(conn);
 }
 
-void
-sp_srv_add_workreq(Spsrv *srv, Spreq *req)
-{
-	if (srv->workreqs)
-		srv->workreqs->prev = req;
-
-	req->next = srv->workreqs;
-	srv->workreqs = req;
-	req->prev = NULL;
-}
-
-void
-sp_srv_remove_workreq(Spsrv *srv, Spreq *req)
-{
-	if (req->prev)
-		req->prev->next = req->next;
-	else
-		srv->workreqs = req->next;
-
-	if (req->next)
-		req->next->prev = req->prev;
-}
-
 typedef Spfcall* (*sp_fcall)(Spreq *, Spfcall *);
 static sp_fcall sp_fcalls[] = {
 	sp_version,
@@ -181,26 +207,6 @@ static sp_fcall sp_fcalls[] = {
 	sp_wstat,
 };
 
-Spfcall *
-sp_srv_get_enomem(Spsrv *srv, int dotu)
-{
-	Spfcall *rc;
-
-	if (dotu)
-		rc = srv->rcenomemu;
-	else
-		rc = srv->rcenomem;
-
-	srv->enomem = 1;
-	return rc;
-}
-
-void
-sp_srv_put_enomem(Spsrv *srv)
-{
-	srv->enomem = 0;
-}
-
 void
 sp_srv_process_req(Spreq *req)
 {
@@ -211,9 +217,24 @@ sp_srv_process_req(Spreq *req)
 	sp_fcall f;
 
 	conn = req->conn;
-	sp_srv_add_workreq(conn->srv, req);
-
+	conn->atime = time(NULL);
 	tc = req->tcall;
+
+	/* the client shouldn't reuse a tag before it gets the response;
+	   an answer would go to the request that has the tag, drop it */
+	if (sp_conn_find_workreq(conn, req->tag)) {
+		if (conn->srv->debuglevel)
+			fprintf(stderr, "dropping request (%p) with %s %d\n",
+				conn, Eduptag, req->tag);
+
+		sp_conn_free_incall(conn, tc);
+		sp_req_free(req);
+		return;
+	}
+
+	conn->nreqs++;
+
+	sp_conn_add_workreq(conn, req);
 	f = NULL;
 	if (tc->type<Tfirst && tc->type>Rlast)
 		sp_werror("unknown message type", ENOSYS);
@@ -229,12 +250,12 @@ sp_srv_process_req(Spreq *req)
 	sp_rerror(&ename, &ecode);
 	if (ename != NULL) {
 		if (rc)
-			free(rc);
+			sp_fcall_free(rc);
 
 		/* if there is not enough memory, use one of the 
 		   preallocated error responses */
 		if (ename == Enomem) 
-			rc = sp_srv_get_enomem(conn->srv, conn->dotu);
+			rc = sp_conn_get_enomem(conn);
 		else
 			rc = sp_create_rerror(ename, ecode, conn->dotu);
 	}
@@ -242,19 +263,19 @@ sp_srv_process_req(Spreq *req)
 
 	if (rc)
 		sp_respond(req, rc);
+	else if (ename == Enomem)
+		sp_conn_wait_enomem(conn, req);
 }
 
 void
 sp_respond(Spreq *req, Spfcall *rc)
 {
-	Spsrv *srv;
 	Spreq *freq, *freq1;
 
-	srv = req->conn->srv;
 	req->rcall = rc;
-	sp_srv_remove_workreq(srv, req);
+	sp_conn_remove_workreq(req->conn, req);
 	for(freq = req->flushreq; freq != NULL; freq = freq->flushreq)
-		sp_srv_remove_workreq(srv, freq);
+		sp_conn_remove_workreq(freq->conn, freq);
 
 	if (req->rcall && req->rcall->type==Rread && req->fid->type&Qtdir)
 		req->fid->diroffset = req->tcall->offset + req->rcall->count;
@@ -293,8 +314,15 @@ sp_default_version(Spconn *conn, u32 msize, Spstr *version)
 	if (msize > conn->srv->msize)
 		msize = conn->srv->msize;
 
+	/* "9P2000.u.fd" asks for the open files with Ropen, if the
+	   transport can pass them */
 	dotu = 0;
-	if (sp_strcmp(version, "9P2000.u")==0 && conn->srv->dotu)
+	conn->flags &= ~Cpassfd;
+	if (sp_strcmp(version, "9P2000.u.fd")==0 && conn->srv->dotu) {
+		dotu = 1;
+		if (conn->flags&Cfdcap && conn->srv->openfd)
+			conn->flags |= Cpassfd;
+	} else if (sp_strcmp(version, "9P2000.u")==0 && conn->srv->dotu)
 		dotu = 1;
 	else if (sp_strncmp(version, "9P2000", 6) == 0)
 		dotu = 0;
@@ -415,8 +443,12 @@ Spreq *sp_req_alloc(Spconn *conn, Spfcall *tc) {
 	req->flushreq = NULL;
 	req->next = NULL;
 	req->prev = NULL;
+	req->tnext = NULL;
 	req->fid = NULL;
+	req->fd = -1;
+	req->wpos = 0;
 	req->caux = NULL;
+	req->enomemnext = NULL;
 
 	return req;
 }
@@ -424,6 +456,11 @@ Spreq *sp_req_alloc(Spconn *conn, Spfcall *tc) {
 void
 sp_req_free(Spreq *req)
 {
+	if (req->fd >= 0) {
+		close(req->fd);
+		req->fd = -1;
+	}
+
 	if (reqpool.reqnum < 64) {
 		req->next = reqpool.reqlist;
 		reqpool.reqlist = req;
@@ -31,19 +31,20 @@
 #include "spfs.h"
 #include "spfsimpl.h"
 
+/* per thread, the users are only compared within a thread's connections */
 struct Usercache {
 	int		init;
 	int		hsize;
 	Spuser**	htable;
-} usercache = { 0 };
+} __thread usercache = { 0 };
 
 struct Spgroupcache {
 	int		init;
 	int		hsize;
 	Spgroup**	htable;
-} groupcache = { 0 };
+} __thread groupcache = { 0 };
 
-Spuser *currentUser;
+__thread Spuser *currentUser;
 
 static void
 initusercache(void)
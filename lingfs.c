@@ -23,6 +23,7 @@
 
 //#define _XOPEN_SOURCE 500
 #define _BSD_SOURCE
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -35,6 +36,9 @@
 #include <fcntl.h>
 #include <utime.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <sched.h>
 #include "spfs.h"
 
 #undef NPFS_USE_AIO
@@ -42,6 +46,62 @@
 #define NELEM(x)	(sizeof(x)/sizeof((x)[0]))
 
 typedef struct Fid Fid;
+typedef struct Map Map;
+typedef struct Cent Cent;
+typedef struct Clist Clist;
+typedef struct Rahead Rahead;
+
+/* a file mapped for -m, shared by all fids reading that version of it */
+struct Map {
+	dev_t		dev;
+	ino_t		ino;
+	struct timespec	mtime;
+	off_t		size;
+	char*		addr;
+	int		ref;
+	int		stale;		/* the file changed, not in the table anymore */
+	Map*		next;		/* hash bucket */
+	Map*		lprev;		/* LRU list, most recently used first */
+	Map*		lnext;
+};
+
+/* the contents of a file in the hot file cache, see npfs_cache_get */
+struct Cent {
+	Spdata		data;		/* the responses pointing to buf hold references */
+	dev_t		dev;
+	ino_t		ino;
+	struct timespec	mtime;
+	off_t		size;
+	u32		hash;
+	u8*		buf;
+	int		stale;		/* evicted, the fids go to the file */
+	Clist*		list;		/* NULL once evicted */
+	Cent*		next;		/* hash bucket */
+	Cent*		lprev;		/* list, most recently used first */
+	Cent*		lnext;
+};
+
+struct Clist {
+	Cent*		head;
+	Cent*		tail;
+	size_t		bytes;
+	size_t		max;
+};
+
+/* read-ahead of a fid that is read sequentially */
+struct Rahead {
+	int		fd;
+	u64		seq;		/* where the next sequential read starts */
+	int		window;		/* bytes to read ahead, 0 if not reading ahead */
+	u8*		buf;
+	int		bufsize;
+	u64		off;		/* file offset of buf */
+	int		len;		/* bytes in buf, the pread result */
+	int		want;		/* bytes asked for */
+	unsigned long	gen;		/* writegen when it was read */
+	int		busy;		/* queued or being read */
+	Rahead*		next;		/* prefetch queue */
+};
 
 struct Fid {
 	char*		path;
@@ -50,7 +110,10 @@ struct Fid {
 	DIR*		dir;
 	int		diroffset;
 	char*		direntname;
-	void*		aux;		/* for mmapread */
+	Map*		map;		/* for mmapreads */
+	Cent*		cent;		/* hot file cache entry */
+	Rahead*		ra;
+	int		nocache;	/* the file changed since it was opened */
 	struct stat	stat;
 };
 
@@ -58,6 +121,12 @@ Spsrv *srv;
 int debuglevel = 0;
 int sameuser;
 int mmapreads;
+size_t mapcachesize = 256*1024*1024;
+size_t cachesize;
+int ramax;
+int busypoll;
+int cpu = -1;
+Spsrv **srvs;
 
 char *Estatfailed = "stat failed";
 char *Ebadfid = "fid unknown or out of range";
@@ -85,13 +154,128 @@ static Spfcall* npfs_clunk(Spfid *fid);
 static Spfcall* npfs_remove(Spfid *fid);
 static Spfcall* npfs_stat(Spfid *fid);
 static Spfcall* npfs_wstat(Spfid *fid, Spstat *stat);
+static int npfs_openfd(Spfid *fid);
 
 static void npfs_fiddestroy(Spfid *fid);
+static void create_rerror(int ecode);
+static void npfs_cache_init(void);
+static int npfs_rainit(int nthreads);
+
+static Spsrv*
+npfs_ethsrv(char *ifname, int ringblocks, int xdpqueue, int xdpflags, int fanout)
+{
+	Spsrv *srv;
+
+	srv = sp_ethsrv2_create(ifname);
+	if (!srv)
+		return NULL;
+
+	if (ringblocks > 0 && sp_ethsrv2_set_rxring(srv, ringblocks) < 0)
+		return NULL;
+
+	if (xdpqueue >= 0 && sp_ethsrv2_set_xdp(srv, xdpqueue, xdpflags) < 0)
+		return NULL;
+
+	if (fanout && sp_ethsrv2_set_fanout(srv, fanout) < 0)
+		return NULL;
+
+	if (busypoll && sp_ethsrv2_set_busypoll(srv, busypoll) < 0)
+		return NULL;
+
+	return srv;
+}
+
+static void
+npfs_initsrv(Spsrv *srv, int maxconns, int conntimeout)
+{
+	srv->dotu = 1;
+	srv->attach = npfs_attach;
+	srv->clone = npfs_clone;
+	srv->walk = npfs_walk;
+	srv->open = npfs_open;
+	srv->create = npfs_create;
+	srv->read = npfs_read;
+	srv->write = npfs_write;
+	srv->clunk = npfs_clunk;
+	srv->remove = npfs_remove;
+	srv->stat = npfs_stat;
+	srv->wstat = npfs_wstat;
+	srv->openfd = npfs_openfd;
+	srv->fiddestroy = npfs_fiddestroy;
+	srv->debuglevel = debuglevel;
+	srv->maxconns = maxconns;
+	srv->conntimeout = conntimeout;
+}
+
+static void
+npfs_pollstats(Sptimer *t, void *a)
+{
+	Sppollstats st;
+
+	sp_poll_get_stats(&st);
+	fprintf(stderr, "npfs: loop %ld: %llu polls, %llu spins, %llu%% found work, %llu ms spinning\n",
+		(long) a, st.polls, st.spins,
+		st.spins ? st.spinhits * 100 / st.spins : 0, st.spinusec / 1000);
+}
+
+/* pin the calling thread's loop to cpu + n and set up busy polling */
+static int
+npfs_setloop(long n)
+{
+	cpu_set_t cpus;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu + n, &cpus);
+		errno = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (errno) {
+			perror("pthread_setaffinity_np");
+			return -1;
+		}
+	}
+
+	if (busypoll) {
+		sp_poll_set_busypoll(busypoll);
+		if (debuglevel)
+			sp_timer_add(10000, npfs_pollstats, (void *) n);
+	}
+
+	return 0;
+}
+
+/* each fanout thread runs its own server and loop */
+static void *
+npfs_loop(void *a)
+{
+	Spsrv *srv;
+
+	srv = srvs[(long) a];
+	if (npfs_setloop((long) a) < 0)
+		exit(-1);
+
+	sp_srv_start(srv);
+	sp_poll_loop();
+	return NULL;
+}
+
+static int
+npfs_srverror()
+{
+	int ecode;
+	char *ename;
+
+	if (sp_haserror()) {
+		sp_rerror(&ename, &ecode);
+		fprintf(stderr, "%s\n", ename);
+	}
+
+	return -1;
+}
 
 void
 usage()
 {
-	fprintf(stderr, "npfs: -d -s [-x ifname | -p port] -w nthreads\n");
+	fprintf(stderr, "npfs: -d -s [-x ifpattern] [-p port] [-u unixsocket] [-U seqpacketsocket] [-S shmsocket] -w nthreads -c maxconns -t idletimeout -b backlog -B bufsize -r ringblocks -X xdpqueue [-D] [-y] -F nthreads [-P busypollusec] [-C cpu] [-m] [-M mapcachemb] [-H hotcachemb] [-A readaheadkb]\n");
 	exit(-1);
 }
 
@@ -99,43 +283,128 @@ int
 main(int argc, char **argv)
 {
 	int c;
-	int port, nwthreads;
-	char *ifname;
+	int port, nwthreads, maxconns, conntimeout, backlog, bufsize, ringblocks;
+	int xdpqueue, xdpflags, nthreads, nmsrvs, i;
+	char *ifname, *shmpath, *unixpath, *seqpath;
+	Spsrv *msrvs[5];
+	pthread_t tid;
 	char *s;
 
 	int use_tcp = 0;
 	int use_eth = 0;
+	int use_shm = 0;
 
 	port = 564;
+	unixpath = NULL;
+	seqpath = NULL;
 	nwthreads = 16;
-	while ((c = getopt(argc, argv, "dsmx:p:w:")) != -1) {
+	maxconns = 0;
+	conntimeout = 0;
+	backlog = 0;
+	bufsize = 0;
+	ringblocks = 0;
+	xdpqueue = -1;
+	xdpflags = 0;
+	nthreads = 1;
+	while ((c = getopt(argc, argv, "dsmM:H:A:x:p:u:U:S:w:c:t:b:B:r:X:DyF:P:C:")) != -1) {
 		switch (c) {
 		case 'd':
 			debuglevel++;
 			break;
 
 		case 'x':
-			if (use_tcp)
-				usage();
 			ifname = optarg;
 			use_eth = 1;
 			break;
 
 		case 'p':
-			if (use_eth)
-				usage();
 			port = strtol(optarg, &s, 10);
 			if (*s != '\0')
 				usage();
 			use_tcp = 1;
 			break;
 
+		case 'u':
+			unixpath = optarg;
+			break;
+
+		case 'U':
+			seqpath = optarg;
+			break;
+
+		case 'S':
+			shmpath = optarg;
+			use_shm = 1;
+			break;
+
 		case 'w':
 			nwthreads = strtol(optarg, &s, 10);
 			if (*s != '\0')
 				usage();
 			break;
 
+		case 'c':
+			maxconns = strtol(optarg, &s, 10);
+			if (*s != '\0')
+				usage();
+			break;
+
+		case 't':
+			conntimeout = strtol(optarg, &s, 10);
+			if (*s != '\0')
+				usage();
+			break;
+
+		case 'b':
+			backlog = strtol(optarg, &s, 10);
+			if (*s != '\0')
+				usage();
+			break;
+
+		case 'B':
+			bufsize = strtol(optarg, &s, 10);
+			if (*s != '\0')
+				usage();
+			break;
+
+		case 'r':
+			ringblocks = strtol(optarg, &s, 10);
+			if (*s != '\0')
+				usage();
+			break;
+
+		case 'X':
+			xdpqueue = strtol(optarg, &s, 10);
+			if (*s != '\0')
+				usage();
+			break;
+
+		case 'D':
+			xdpflags |= Xdrvmode;
+			break;
+
+		case 'y':
+			xdpflags |= Xbusypoll;
+			break;
+
+		case 'F':
+			nthreads = strtol(optarg, &s, 10);
+			if (*s != '\0' || nthreads < 1)
+				usage();
+			break;
+
+		case 'P':
+			busypoll = strtol(optarg, &s, 10);
+			if (*s != '\0' || busypoll < 0)
+				usage();
+			break;
+
+		case 'C':
+			cpu = strtol(optarg, &s, 10);
+			if (*s != '\0' || cpu < 0)
+				usage();
+			break;
+
 		case 's':
 			sameuser = 1;
 			break;
@@ -144,37 +413,120 @@ main(int argc, char **argv)
 			mmapreads = 1;
 			break;
 
+		case 'M':
+			mapcachesize = strtoul(optarg, &s, 10) << 20;
+			if (*s != '\0')
+				usage();
+			mmapreads = 1;
+			break;
+
+		case 'H':
+			cachesize = strtoul(optarg, &s, 10) << 20;
+			if (*s != '\0')
+				usage();
+			break;
+
+		case 'A':
+			ramax = strtol(optarg, &s, 10) << 10;
+			if (*s != '\0' || ramax < 0)
+				usage();
+			break;
+
 		default:
 			usage();
 		}
 	}
 
-	if (!use_tcp && !use_eth)
+	if (!use_tcp && !use_eth && !use_shm && !unixpath && !seqpath)
 		use_tcp = 1;
 
-	srv = (use_tcp)
-		?sp_socksrv_create_tcp(&port)
-		:sp_ethsrv2_create(ifname);
+	if (cachesize)
+		npfs_cache_init();
 
-	if (!srv)
+	/* the worker threads read ahead */
+	if (ramax && npfs_rainit(nwthreads) < 0)
 		return -1;
 
-	srv->dotu = 1;
-	srv->attach = npfs_attach;
-	srv->clone = npfs_clone;
-	srv->walk = npfs_walk;
-	srv->open = npfs_open;
-	srv->create = npfs_create;
-	srv->read = npfs_read;
-	srv->write = npfs_write;
-	srv->clunk = npfs_clunk;
-	srv->remove = npfs_remove;
-	srv->stat = npfs_stat;
-	srv->wstat = npfs_wstat;
-	srv->fiddestroy = npfs_fiddestroy;
-	srv->debuglevel = debuglevel;
+	/* the user is switched for the whole process, not per thread */
+	if (nthreads > 1 && (!use_eth || xdpqueue >= 0 || !sameuser)) {
+		fprintf(stderr, "npfs: -F needs -x and -s, and can't be used with -X\n");
+		return -1;
+	}
+
+	/* the main thread serves all transports, and the first
+	   of the fanout servers */
+	nmsrvs = 0;
+	if (use_tcp) {
+		srv = sp_socksrv_create_tcp(&port);
+		if (!srv)
+			return npfs_srverror();
+
+		sp_socksrv_set_backlog(srv, backlog);
+		sp_socksrv_set_bufsize(srv, bufsize, bufsize);
+		sp_socksrv_set_busypoll(srv, busypoll);
+		msrvs[nmsrvs++] = srv;
+	}
+
+	if (unixpath) {
+		srv = sp_socksrv_create_unix(unixpath, SOCK_STREAM);
+		if (!srv)
+			return npfs_srverror();
+
+		sp_socksrv_set_backlog(srv, backlog);
+		sp_socksrv_set_bufsize(srv, bufsize, bufsize);
+		msrvs[nmsrvs++] = srv;
+	}
+
+	if (seqpath) {
+		srv = sp_socksrv_create_unix(seqpath, SOCK_SEQPACKET);
+		if (!srv)
+			return npfs_srverror();
+
+		sp_socksrv_set_backlog(srv, backlog);
+		sp_socksrv_set_bufsize(srv, bufsize, bufsize);
+		msrvs[nmsrvs++] = srv;
+	}
+
+	if (use_shm) {
+		srv = sp_shmsrv_create(shmpath);
+		if (!srv)
+			return npfs_srverror();
+
+		msrvs[nmsrvs++] = srv;
+	}
+
+	if (use_eth) {
+		srvs = calloc(nthreads, sizeof(Spsrv *));
+		if (!srvs)
+			return -1;
+
+		for(i = 0; i < nthreads; i++) {
+			srvs[i] = npfs_ethsrv(ifname, ringblocks, xdpqueue, xdpflags,
+				nthreads > 1 ? getpid() : 0);
+
+			if (!srvs[i])
+				return npfs_srverror();
+		}
+
+		for(i = 1; i < nthreads; i++) {
+			npfs_initsrv(srvs[i], maxconns, conntimeout);
+			if (pthread_create(&tid, NULL, npfs_loop, (void *) (long) i) != 0) {
+				perror("pthread_create");
+				return -1;
+			}
+		}
+
+		msrvs[nmsrvs++] = srvs[0];
+	}
+
+	for(i = 0; i < nmsrvs; i++) {
+		npfs_initsrv(msrvs[i], maxconns, conntimeout);
+		sp_srv_start(msrvs[i]);
+	}
+
+	if (npfs_setloop(0) < 0)
+		return -1;
 
-	sp_srv_start(srv);
 	sp_poll_loop();
 	return 0;
 }
@@ -191,6 +543,713 @@ fidstat(Fid *fid)
 	return 0;
 }
 
+enum {
+	Maphashsize	= 1024,
+};
+
+static Map *maphash[Maphashsize];
+static Map *maplru;
+static Map *maplrutail;
+static size_t mapsize;		/* mapped by the maps in the table */
+static pthread_mutex_t maplock = PTHREAD_MUTEX_INITIALIZER;
+
+static Map**
+npfs_map_bucket(dev_t dev, ino_t ino)
+{
+	return &maphash[(dev ^ ino) % Maphashsize];
+}
+
+static void
+npfs_map_free(Map *m)
+{
+	if (m->addr)
+		munmap(m->addr, m->size);
+	free(m);
+}
+
+/* take the map out of the table, it goes away with the last fid using it */
+static void
+npfs_map_unlink(Map *m)
+{
+	Map **pm;
+
+	for(pm = npfs_map_bucket(m->dev, m->ino); *pm != m; pm = &(*pm)->next)
+		;
+	*pm = m->next;
+
+	if (m->lprev)
+		m->lprev->lnext = m->lnext;
+	else
+		maplru = m->lnext;
+	if (m->lnext)
+		m->lnext->lprev = m->lprev;
+	else
+		maplrutail = m->lprev;
+
+	mapsize -= m->size;
+	__atomic_store_n(&m->stale, 1, __ATOMIC_RELEASE);
+	if (!m->ref)
+		npfs_map_free(m);
+}
+
+/* drop the least recently used maps nobody has open until the total
+   size is within mapcachesize */
+static void
+npfs_map_trim(void)
+{
+	Map *m, *prev;
+
+	for(m = maplrutail; m != NULL && mapsize > mapcachesize; m = prev) {
+		prev = m->lprev;
+		if (!m->ref)
+			npfs_map_unlink(m);
+	}
+}
+
+static Map*
+npfs_map_find(dev_t dev, ino_t ino)
+{
+	Map *m;
+
+	for(m = *npfs_map_bucket(dev, ino); m != NULL; m = m->next)
+		if (m->dev == dev && m->ino == ino)
+			break;
+
+	return m;
+}
+
+/* returns the map of the current version of the open file, with a
+   reference for the caller */
+static Map*
+npfs_map_get(int fd)
+{
+	Map *m, **pm;
+	struct stat st;
+
+	if (fstat(fd, &st) < 0) {
+		create_rerror(errno);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&maplock);
+	m = npfs_map_find(st.st_dev, st.st_ino);
+	if (m && (m->size != st.st_size
+	    || m->mtime.tv_sec != st.st_mtim.tv_sec
+	    || m->mtime.tv_nsec != st.st_mtim.tv_nsec)) {
+		npfs_map_unlink(m);
+		m = NULL;
+	}
+
+	if (m) {
+		m->ref++;
+
+		/* move to the front of the LRU list */
+		if (m->lprev) {
+			m->lprev->lnext = m->lnext;
+			if (m->lnext)
+				m->lnext->lprev = m->lprev;
+			else
+				maplrutail = m->lprev;
+
+			m->lprev = NULL;
+			m->lnext = maplru;
+			maplru->lprev = m;
+			maplru = m;
+		}
+
+		goto done;
+	}
+
+	m = malloc(sizeof(*m));
+	if (!m) {
+		sp_werror(Enomem, ENOMEM);
+		goto done;
+	}
+
+	m->dev = st.st_dev;
+	m->ino = st.st_ino;
+	m->mtime = st.st_mtim;
+	m->size = st.st_size;
+	m->addr = NULL;
+	m->ref = 1;
+	m->stale = 0;
+
+	/* empty files can't be mapped, there is nothing to read anyway */
+	if (m->size > 0) {
+		m->addr = mmap(0, m->size, PROT_READ, MAP_SHARED, fd, 0);
+		if (m->addr == MAP_FAILED) {
+			create_rerror(errno);
+			free(m);
+			m = NULL;
+			goto done;
+		}
+	}
+
+	pm = npfs_map_bucket(m->dev, m->ino);
+	m->next = *pm;
+	*pm = m;
+	m->lprev = NULL;
+	m->lnext = maplru;
+	if (maplru)
+		maplru->lprev = m;
+	else
+		maplrutail = m;
+	maplru = m;
+	mapsize += m->size;
+	npfs_map_trim();
+
+done:
+	pthread_mutex_unlock(&maplock);
+	return m;
+}
+
+static void
+npfs_map_put(Map *m)
+{
+	pthread_mutex_lock(&maplock);
+	m->ref--;
+	if (!m->ref) {
+		if (m->stale)
+			npfs_map_free(m);
+		else
+			npfs_map_trim();
+	}
+	pthread_mutex_unlock(&maplock);
+}
+
+/* the file is changed through us, the fids reading it map it again */
+static void
+npfs_map_invalidate(struct stat *st)
+{
+	Map *m;
+
+	pthread_mutex_lock(&maplock);
+	m = npfs_map_find(st->st_dev, st->st_ino);
+	if (m)
+		npfs_map_unlink(m);
+	pthread_mutex_unlock(&maplock);
+}
+
+/*
+ * Hot file cache. Small files read through lingfs are kept whole in
+ * memory, the reads are answered with responses that point to the
+ * cached bytes. The entries are for a version of the file, (dev, ino,
+ * mtime, size) when the fid was opened. A fid holds a reference to the
+ * entry from its first read on, so the uses are counted per open.
+ *
+ * The policy is W-TinyLFU, by bytes: new entries go to a small LRU
+ * window. Those that fall out of it get into the main cache only if
+ * they were used more often than the entries they would push out,
+ * going by a count-min sketch of recent uses. The main cache is a
+ * segmented LRU, probation and protected. A file is read in only if
+ * it fits in the window and would get into the main cache as it is
+ * used now, the others are read from the file.
+ */
+enum {
+	Chashsize	= 4096,
+	Csketchsize	= 16384,	/* counters, power of 2 */
+	Csketchrows	= 4,
+};
+
+static Cent *chash[Chashsize];
+static Clist cwindow;
+static Clist cprobation;
+static Clist cprotected;
+static size_t cmainmax;		/* probation and protected */
+static u8 csketch[Csketchsize];
+static int csketchadds;
+static pthread_mutex_t cachelock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+npfs_cache_init(void)
+{
+	cwindow.max = cachesize / 100;
+	cmainmax = cachesize - cwindow.max;
+	cprotected.max = cmainmax / 10 * 8;
+}
+
+static u32
+npfs_cache_hash(dev_t dev, ino_t ino)
+{
+	u64 h;
+
+	h = (u64) dev * 0x9e3779b97f4a7c15ULL ^ ino;
+	h ^= h >> 31;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 29;
+	return h;
+}
+
+static int
+npfs_cache_sketchidx(u32 hash, int row)
+{
+	return (hash + row * ((hash >> 16) | 1)) & (Csketchsize - 1);
+}
+
+/* estimated recent uses */
+static int
+npfs_cache_freq(u32 hash)
+{
+	int i, n, freq;
+
+	freq = 15;
+	for(i = 0; i < Csketchrows; i++) {
+		n = csketch[npfs_cache_sketchidx(hash, i)];
+		if (n < freq)
+			freq = n;
+	}
+
+	return freq;
+}
+
+/* count a use, the counters are halved from time to time so that the
+   old uses count less */
+static void
+npfs_cache_sketchadd(u32 hash)
+{
+	int i, freq;
+	u8 *p;
+
+	freq = npfs_cache_freq(hash);
+	for(i = 0; i < Csketchrows; i++) {
+		p = &csketch[npfs_cache_sketchidx(hash, i)];
+		if (*p == freq && freq < 15)
+			(*p)++;
+	}
+
+	if (++csketchadds >= 10 * Csketchsize) {
+		for(i = 0; i < Csketchsize; i++)
+			csketch[i] >>= 1;
+		csketchadds = 0;
+	}
+}
+
+static void
+npfs_clist_remove(Clist *l, Cent *c)
+{
+	if (c->lprev)
+		c->lprev->lnext = c->lnext;
+	else
+		l->head = c->lnext;
+	if (c->lnext)
+		c->lnext->lprev = c->lprev;
+	else
+		l->tail = c->lprev;
+
+	l->bytes -= c->size;
+	c->list = NULL;
+}
+
+static void
+npfs_clist_push(Clist *l, Cent *c)
+{
+	c->lprev = NULL;
+	c->lnext = l->head;
+	if (l->head)
+		l->head->lprev = c;
+	else
+		l->tail = c;
+	l->head = c;
+	l->bytes += c->size;
+	c->list = l;
+}
+
+static void
+npfs_cache_free(Spdata *d)
+{
+	free(d);
+}
+
+/* drop the cache's reference, the responses may still use it. The
+   fids holding the entry can't be found by a write anymore, they stop
+   using it */
+static void
+npfs_cache_evict(Cent *c)
+{
+	Cent **pc;
+
+	__atomic_store_n(&c->stale, 1, __ATOMIC_RELEASE);
+	for(pc = &chash[c->hash % Chashsize]; *pc != c; pc = &(*pc)->next)
+		;
+	*pc = c->next;
+
+	if (c->list)
+		npfs_clist_remove(c->list, c);
+	sp_data_decref(&c->data);
+}
+
+/* an entry that fell out of the window gets into probation if there
+   is room, or if it is used more often than those it pushes out */
+static void
+npfs_cache_admit(Cent *c)
+{
+	Cent *victim;
+
+	while (cprobation.bytes + cprotected.bytes + c->size > cmainmax) {
+		victim = cprobation.tail;
+		if (!victim)
+			victim = cprotected.tail;
+
+		if (!victim || npfs_cache_freq(c->hash) <= npfs_cache_freq(victim->hash)) {
+			npfs_cache_evict(c);
+			return;
+		}
+
+		npfs_cache_evict(victim);
+	}
+
+	npfs_clist_push(&cprobation, c);
+}
+
+static void
+npfs_cache_touch(Cent *c)
+{
+	Clist *l;
+
+	l = c->list;
+	npfs_clist_remove(l, c);
+	if (l == &cwindow) {
+		npfs_clist_push(&cwindow, c);
+		return;
+	}
+
+	/* used again, moves to (or stays in) protected, the least recently
+	   used of protected go back to probation */
+	npfs_clist_push(&cprotected, c);
+	while (cprotected.bytes > cprotected.max && cprotected.tail != c) {
+		c = cprotected.tail;
+		npfs_clist_remove(&cprotected, c);
+		npfs_clist_push(&cprobation, c);
+	}
+}
+
+static Cent*
+npfs_cache_find(dev_t dev, ino_t ino, u32 hash)
+{
+	Cent *c;
+
+	for(c = chash[hash % Chashsize]; c != NULL; c = c->next)
+		if (c->dev == dev && c->ino == ino)
+			break;
+
+	return c;
+}
+
+static int
+npfs_cache_current(Cent *c, struct stat *st)
+{
+	return c->size == st->st_size
+		&& c->mtime.tv_sec == st->st_mtim.tv_sec
+		&& c->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* look up the entry for the version of the file in st, NULL if it
+   isn't cached, with a reference for the caller */
+static Cent*
+npfs_cache_lookup(struct stat *st, u32 hash)
+{
+	Cent *c;
+
+	c = npfs_cache_find(st->st_dev, st->st_ino, hash);
+	if (c && !npfs_cache_current(c, st)) {
+		npfs_cache_evict(c);
+		c = NULL;
+	}
+
+	if (c) {
+		npfs_cache_touch(c);
+		sp_data_incref(&c->data);
+	}
+
+	return c;
+}
+
+/* whether a file not cached yet is worth reading in: there is room for
+   it in the main cache, or it is used more often than the entry it
+   would push out first */
+static int
+npfs_cache_wanted(u32 hash, off_t size)
+{
+	Cent *victim;
+
+	if (cprobation.bytes + cprotected.bytes + size <= cmainmax)
+		return 1;
+
+	victim = cprobation.tail;
+	if (!victim)
+		victim = cprotected.tail;
+
+	return victim && npfs_cache_freq(hash) > npfs_cache_freq(victim->hash);
+}
+
+/* returns the cache entry of the open file, reading it in if it isn't
+   cached yet and is wanted, with a reference for the caller. NULL if
+   the file isn't cached, or changed since it was opened. */
+static Cent*
+npfs_cache_get(Fid *f)
+{
+	int n, wanted;
+	off_t off;
+	u32 hash;
+	Cent *c, *c1;
+	struct stat st;
+
+	/* empty files would take no room, there would be no limit */
+	if (!S_ISREG(f->stat.st_mode) || f->stat.st_size == 0
+	|| f->stat.st_size > cwindow.max)
+		return NULL;
+
+	hash = npfs_cache_hash(f->stat.st_dev, f->stat.st_ino);
+	pthread_mutex_lock(&cachelock);
+	npfs_cache_sketchadd(hash);
+	c = npfs_cache_lookup(&f->stat, hash);
+	wanted = c || npfs_cache_wanted(hash, f->stat.st_size);
+	pthread_mutex_unlock(&cachelock);
+	if (c || !wanted)
+		return c;
+
+	c = malloc(sizeof(*c) + f->stat.st_size);
+	if (!c)
+		return NULL;
+
+	c->data.ref = 2;	/* the cache and the caller */
+	c->data.free = npfs_cache_free;
+	c->dev = f->stat.st_dev;
+	c->ino = f->stat.st_ino;
+	c->mtime = f->stat.st_mtim;
+	c->size = f->stat.st_size;
+	c->hash = hash;
+	c->buf = (u8 *) c + sizeof(*c);
+	c->stale = 0;
+	c->list = NULL;
+	for(off = 0; off < c->size; off += n) {
+		n = pread(f->fd, c->buf + off, c->size - off, off);
+		if (n <= 0)
+			break;
+	}
+
+	/* the file changed under us, the reads go to the file */
+	if (off < c->size || fstat(f->fd, &st) < 0 || !npfs_cache_current(c, &st)) {
+		free(c);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&cachelock);
+	c1 = npfs_cache_lookup(&st, hash);
+	if (c1) {
+		/* another thread got it in first */
+		free(c);
+		c = c1;
+		goto done;
+	}
+
+	c->next = chash[hash % Chashsize];
+	chash[hash % Chashsize] = c;
+	npfs_clist_push(&cwindow, c);
+	while (cwindow.bytes > cwindow.max) {
+		c1 = cwindow.tail;
+		npfs_clist_remove(&cwindow, c1);
+		npfs_cache_admit(c1);
+	}
+
+done:
+	pthread_mutex_unlock(&cachelock);
+	return c;
+}
+
+/* the file is changed through us */
+static void
+npfs_cache_invalidate(struct stat *st)
+{
+	u32 hash;
+	Cent *c;
+
+	hash = npfs_cache_hash(st->st_dev, st->st_ino);
+	pthread_mutex_lock(&cachelock);
+	c = npfs_cache_find(st->st_dev, st->st_ino, hash);
+	if (c)
+		npfs_cache_evict(c);
+	pthread_mutex_unlock(&cachelock);
+}
+
+/*
+ * Read-ahead. A fid that reads where its last read ended is read
+ * sequentially. Once its buffer is used up, the next window is read by
+ * one of the prefetch threads so that the next Tread is served from
+ * memory. The window starts at twice the read size and doubles each
+ * time the data read ahead is used, up to ramax, and is dropped by the
+ * first read elsewhere. Writes through lingfs make all data read ahead
+ * before them stale.
+ */
+static Rahead *raqueue;
+static Rahead *raqueuetail;
+static unsigned long writegen;
+static pthread_mutex_t ralock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rawork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t radone = PTHREAD_COND_INITIALIZER;
+
+static void *
+npfs_raproc(void *a)
+{
+	int n;
+	Rahead *ra;
+
+	pthread_mutex_lock(&ralock);
+	for(;;) {
+		while (!raqueue)
+			pthread_cond_wait(&rawork, &ralock);
+
+		ra = raqueue;
+		raqueue = ra->next;
+		if (!raqueue)
+			raqueuetail = NULL;
+		pthread_mutex_unlock(&ralock);
+
+		n = pread(ra->fd, ra->buf, ra->want, ra->off);
+
+		pthread_mutex_lock(&ralock);
+		ra->len = n;
+		ra->busy = 0;
+		pthread_cond_broadcast(&radone);
+	}
+
+	return NULL;
+}
+
+static int
+npfs_rainit(int nthreads)
+{
+	int i;
+	pthread_t tid;
+
+	for(i = 0; i < nthreads; i++) {
+		if (pthread_create(&tid, NULL, npfs_raproc, NULL) != 0) {
+			perror("pthread_create");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* called with ralock held */
+static void
+npfs_rawait(Rahead *ra)
+{
+	while (ra->busy)
+		pthread_cond_wait(&radone, &ralock);
+}
+
+/* read through the fid's read-ahead buffer */
+static int
+npfs_raread(Fid *f, u8 *data, u64 offset, u32 count)
+{
+	int n, hit;
+	u64 next;
+	u8 *buf;
+	Rahead *ra;
+
+	ra = f->ra;
+	if (!ra) {
+		ra = calloc(1, sizeof(*ra));
+		if (!ra)
+			return pread(f->fd, data, count, offset);
+
+		ra->fd = f->fd;
+		f->ra = ra;
+	}
+
+	pthread_mutex_lock(&ralock);
+	if (offset != ra->seq)
+		ra->window = 0;
+
+	/* the data may be on its way */
+	if (ra->window && ra->busy && offset >= ra->off && offset < ra->off + ra->want)
+		npfs_rawait(ra);
+
+	hit = 0;
+	if (ra->window && !ra->busy && ra->gen == writegen
+	&& offset >= ra->off && offset + count <= ra->off + ra->len) {
+		memcpy(data, ra->buf + (offset - ra->off), count);
+		hit = 1;
+	}
+	pthread_mutex_unlock(&ralock);
+
+	n = count;
+	if (!hit) {
+		n = pread(f->fd, data, count, offset);
+		if (n < 0)
+			return n;
+	}
+
+	pthread_mutex_lock(&ralock);
+	next = offset + n;
+	if (offset == ra->seq && n == count && !ra->busy
+	&& (ra->gen != writegen || next < ra->off || next >= ra->off + ra->len)) {
+		/* the next read isn't in the buffer, read the next window,
+		   a bigger one if the last was used */
+		if (!ra->window)
+			ra->window = 2 * count;
+		else if (hit)
+			ra->window *= 2;
+
+		if (ra->window > ramax)
+			ra->window = ramax;
+
+		buf = ra->buf;
+		if (ra->bufsize < ra->window) {
+			buf = realloc(ra->buf, ra->window);
+			if (buf) {
+				ra->buf = buf;
+				ra->bufsize = ra->window;
+			}
+		}
+
+		if (buf) {
+			ra->off = next;
+			ra->want = ra->window;
+			ra->len = 0;
+			ra->gen = writegen;
+			ra->busy = 1;
+			ra->next = NULL;
+			if (raqueuetail)
+				raqueuetail->next = ra;
+			else
+				raqueue = ra;
+			raqueuetail = ra;
+			pthread_cond_signal(&rawork);
+		}
+	}
+
+	ra->seq = offset + n;
+	pthread_mutex_unlock(&ralock);
+
+	return n;
+}
+
+static void
+npfs_rafree(Rahead *ra)
+{
+	pthread_mutex_lock(&ralock);
+	npfs_rawait(ra);
+	pthread_mutex_unlock(&ralock);
+	free(ra->buf);
+	free(ra);
+}
+
+static void
+npfs_invalidate(struct stat *st)
+{
+	if (ramax)
+		__atomic_add_fetch(&writegen, 1, __ATOMIC_RELAXED);
+
+	if (mmapreads)
+		npfs_map_invalidate(st);
+
+	if (cachesize)
+		npfs_cache_invalidate(st);
+}
+
 static Fid*
 npfs_fidalloc() {
 	Fid *f;
@@ -203,6 +1262,10 @@ npfs_fidalloc() {
 	f->dir = NULL;
 	f->diroffset = 0;
 	f->direntname = NULL;
+	f->map = NULL;
+	f->cent = NULL;
+	f->nocache = 0;
+	f->ra = NULL;
 
 	return f;
 }
@@ -216,12 +1279,22 @@ npfs_fiddestroy(Spfid *fid)
 	if (!f)
 		return;
 
+	/* before the file is closed under a prefetch thread */
+	if (f->ra)
+		npfs_rafree(f->ra);
+
 	if (f->fd != -1)
 		close(f->fd);
 
 	if (f->dir)
 		closedir(f->dir);
 
+	if (f->map)
+		npfs_map_put(f->map);
+
+	if (f->cent)
+		sp_data_decref(&f->cent->data);
+
 	free(f->path);
 	free(f);
 }
@@ -543,6 +1616,8 @@ npfs_open(Spfid *fid, u8 mode)
 	err = fidstat(f);
 	if (err < 0)
 		create_rerror(err);
+	else if (mode & Otrunc)
+		npfs_invalidate(&f->stat);
 
 	f->omode = mode;
 	ustat2qid(&f->stat, &qid);
@@ -791,34 +1866,71 @@ npfs_read(Spfid *fid, u64 offset, u32 count, Spreq *req)
 {
 	int n;
 	Fid *f;
+	Map *m;
+	Cent *c;
 	Spfcall *ret;
 
 	f = fid->aux;
+	c = f->cent;
+	if (c && __atomic_load_n(&c->stale, __ATOMIC_ACQUIRE)) {
+		sp_data_decref(&c->data);
+		f->cent = c = NULL;
+		f->nocache = 1;
+	}
+
+	if (!c && cachesize && !f->dir && !f->nocache) {
+		c = f->cent = npfs_cache_get(f);
+		if (!c)
+			f->nocache = 1;
+	}
+
+	if (c) {
+		n = 0;
+		if (offset < c->size) {
+			n = count;
+			if (offset + count > c->size)
+				n = c->size - offset;
+		}
+
+		ret = sp_create_rread_ref(n, c->buf + (n ? offset : 0), &c->data);
+		if (!ret)
+			sp_werror(Enomem, ENOMEM);
+
+		return ret;
+	}
+
 	ret = sp_alloc_rread(count);
 	npfs_change_user(fid->user);
 	if (f->dir)
 		n = npfs_read_dir(f, ret->data, offset, count, fid->conn->dotu);
 	else {
-		if(mmapreads) {
-			struct stat s;
-			n = count;
-			if(!f->aux) {
-				fstat(f->fd, &s);
-				f->aux=mmap(0, s.st_size, PROT_READ, 
-						MAP_SHARED, f->fd, 0);
-				if(f->aux < 0) {
-					create_rerror(errno);
-					goto error;	
-				}
+		if (mmapreads) {
+			/* map the file again if it changed, or may have grown */
+			m = f->map;
+			if (!m || __atomic_load_n(&m->stale, __ATOMIC_ACQUIRE)
+			|| offset + count > m->size) {
+				f->map = npfs_map_get(f->fd);
+				if (m)
+					npfs_map_put(m);
+
+				m = f->map;
+				if (!m)
+					goto error;
+			}
+
+			n = 0;
+			if (offset < m->size) {
+				n = count;
+				if (offset + count > m->size)
+					n = m->size - offset;
+
+				memcpy(ret->data, m->addr + offset, n);
 			}
-			if(offset+count > s.st_size)
-				n = s.st_size-offset;
-			if(n>0)
-				memcpy(ret->data, f->aux+offset, n);
-			else 
-				n = 0;
 		} else {
-			n = pread(f->fd, ret->data, count, offset);
+			if (ramax)
+				n = npfs_raread(f, ret->data, offset, count);
+			else
+				n = pread(f->fd, ret->data, count, offset);
 			if (n < 0)
 				create_rerror(errno);
 		}
@@ -846,6 +1958,8 @@ npfs_write(Spfid *fid, u64 offset, u32 count, u8 *data, Spreq *req)
 	n = pwrite(f->fd, data, count, offset);
 	if (n < 0)
 		create_rerror(errno);
+	else
+		npfs_invalidate(&f->stat);
 
 	return sp_create_rwrite(n);
 }
@@ -906,6 +2020,19 @@ npfs_stat(Spfid *fid)
 	return ret;
 }
 
+/* local clients read regular files directly */
+static int
+npfs_openfd(Spfid *fid)
+{
+	Fid *f;
+
+	f = fid->aux;
+	if (f->fd < 0 || !S_ISREG(f->stat.st_mode))
+		return -1;
+
+	return f->fd;
+}
+
 static Spfcall*
 npfs_wstat(Spfid *fid, Spstat *stat)
 {
@@ -1014,6 +2141,8 @@ npfs_wstat(Spfid *fid, Spstat *stat)
 			create_rerror(errno);
 			goto out;
 		}
+
+		npfs_invalidate(&f->stat);
 	}
 	ret = sp_create_rwstat();
 	